@@ -15,10 +15,29 @@
 #include <HardwareSerial.h>
 #include "picsil-Nano.h"
 
-NanoCellular::NanoCellular(int8_t powerPin, int8_t statusPin)
+NanoCellular* NanoCellular::_indicateInstances[INDICATE_MAX_INSTANCES] = {};
+
+// Sent by configureModule(), and by a recovery after a power cycle
+static const char* const configCommands[] =
+{
+    // Disable echo
+    "ATE0",
+    // Report errors as +CME ERROR: <code> for checkResult()
+    "AT+CMEE=1",
+    // Report registration changes, picked up by poll()
+    "AT+CEREG=1",
+    // Report modem sleep for radio time accounting
+    "AT%XMODEMSLEEP=1,500,0",
+    // Start the module data counters
+    "AT%XCONNSTAT=1"
+};
+#define CONFIG_COMMANDS (sizeof(configCommands) / sizeof(configCommands[0]))
+
+NanoCellular::NanoCellular(int8_t powerPin, int8_t statusPin, int8_t indicatePin)
 {
      _powerPin = powerPin;
     _statusPin = statusPin;
+    _indicatePin = indicatePin;
 
     if (_powerPin != NOT_A_PIN)
     {
@@ -29,12 +48,26 @@ NanoCellular::NanoCellular(int8_t powerPin, int8_t statusPin)
     {
         pinMode(_statusPin, INPUT);
     }   
+    if (_indicatePin != NOT_A_PIN)
+    {
+        pinMode(_indicatePin, INPUT_PULLUP);
+    }
 }
 
 bool NanoCellular::begin(HardwareSerial* uart)
 {
-    _uart = uart;		
-    _uart->begin(115200);
+    uart->begin(115200);
+    return begin((Stream*)uart);
+}
+
+bool NanoCellular::begin(Stream* stream)
+{
+    _uart = stream;
+    attachIndicate();
+#ifdef PICSIL_NANO_RTOS
+    startReader();
+#endif
+    PN_LOCK();
 
     PN_DEBUG("Powering off module");
     setPower(false);
@@ -69,14 +102,31 @@ bool NanoCellular::begin(HardwareSerial* uart)
         return false;
     }
 
+    // Turn on the URCs before waiting, so a registration that only
+    // completes after begin() gives up is still picked up by poll()
+    configureModule();
+
+    // The module attaches by itself after power on. With a cached cell,
+    // or a system mode set before begin(), it attaches again through
+    // attachNetwork() instead of scanning every band.
+    if (_cellCache.valid ||
+        _systemModePending)
+    {
+        disconnectNetwork();
+        attachNetwork();
+    }
+
     // Wait for network registration
     PN_DEBUG("Waiting for network registration");
     timeout = 60000;
  
     while (timeout > 0)            
     {
-        if (readReply(500, 1) &&
-            strstr(_buffer, "CONNECTED"))
+        // The +CEREG URC turned on by configureModule() is handled while
+        // waiting and can report registration before CONNECTED shows up
+        if (isRegistered() ||
+            (readReply(500, 1) &&
+            strstr(_buffer, "CONNECTED")))
         {
             PN_DEBUG("Network connected");
             break;
@@ -130,11 +180,9 @@ bool NanoCellular::begin(HardwareSerial* uart)
         PN_ERROR("Network registration failed");
         return false;
     }
-
-    // Disable echo
-    sendAndCheckReply("ATE0", _OK, 1000);
-    // Set verbose error messages
-    sendAndCheckReply("AT+CMEE=2", _OK, 1000);
+    setRadioState(RadioState::On);
+    // Picked up by poll() for the next boot
+    _cellCacheStale = true;
 
     callWatchdog();
     return true;
@@ -142,6 +190,7 @@ bool NanoCellular::begin(HardwareSerial* uart)
 
 uint8_t NanoCellular::getIMEI(char* buffer)
 {
+    PN_LOCK();
     if (sendAndWaitForReply("AT+CGSN=1"))
     {
         char buf[28];
@@ -162,26 +211,62 @@ bool NanoCellular::getStatus()
     return digitalRead(_statusPin) == HIGH;
 }
 
+void NanoCellular::setCapture(NanoCapture* capture)
+{
+    // Written before it is set, so no record comes ahead of the header
+    if (capture != nullptr)
+    {
+        capture->begin();
+    }
+#ifdef PICSIL_NANO_RTOS
+    if (_captureMutex != nullptr)
+    {
+        xSemaphoreTake(_captureMutex, portMAX_DELAY);
+        _capture = capture;
+        xSemaphoreGive(_captureMutex);
+        return;
+    }
+#endif
+    _capture = capture;
+}
+
 void NanoCellular::setWatchdogCallback(WATCHDOG_CALLBACK_SIGNATURE)
 {
+    PN_LOCK();
     this->watchdogcallback = watchdogcallback;
 }
 
 void NanoCellular::flush()
 {
-    while (_uart->available())
+    PN_LOCK();
+    // Sends what compression is holding back
+    flushBlock();
+}
+
+void NanoCellular::flushInput()
+{
+    // A command poll() left running gets its reply first
+    if (_pending != PendingCommand::None)
+    {
+        finishCommand();
+    }
+    // Drop what is left of earlier replies, but hand complete
+    // unsolicited lines on instead of losing them
+    while (readUrc())
     {
-        _uart->read();
     }
+    _urcIndex = 0;
 }
 
 const char* NanoCellular::getFirmwareVersion()
 {
+    PN_LOCK();
 	return _firmwareVersion;
 }
 
 uint8_t NanoCellular::getOperatorId(char* buffer)
 {
+    PN_LOCK();
     // Reply is:
     // +COPS: 0,2,"311480",7
     // OK   
@@ -208,6 +293,7 @@ uint8_t NanoCellular::getOperatorId(char* buffer)
 
 uint8_t NanoCellular::getRSSI()
 {
+    PN_LOCK();
     // Reply is:
     // +CESQ: 99,99,255,255,16,47
     // OK
@@ -240,6 +326,7 @@ uint8_t NanoCellular::getRSSI()
 
 uint8_t NanoCellular::getSIMICCID(char* buffer)
 {
+    PN_LOCK();
     char delim[] = " ";
     // #ICCID: 898600220909A0206023
     // OK
@@ -259,6 +346,7 @@ uint8_t NanoCellular::getSIMICCID(char* buffer)
 
 uint8_t NanoCellular::getSIMIMSI(char* buffer)
 {
+    PN_LOCK();
     char delim[] = "\n";
     // 240080007440698
     // OK
@@ -277,6 +365,7 @@ uint8_t NanoCellular::getSIMIMSI(char* buffer)
 
 double NanoCellular::getVoltage()
 {
+    PN_LOCK();
     // Reply is:
     // %XVBAT: 5059
     // OK
@@ -300,6 +389,7 @@ double NanoCellular::getVoltage()
 
 bool NanoCellular::disconnectNetwork()
 {
+    PN_LOCK();
     // PDP context 0 (default connection) can't be deactivated
     // Set to airplane mode instead
     if (!sendAndCheckReply("AT+CFUN=4", _OK, 30000))
@@ -307,21 +397,19 @@ bool NanoCellular::disconnectNetwork()
         PN_ERROR("Failed to set airplane mode.");
         return false;
     }
+    setRadioState(RadioState::Off);
     return true;
 }
 
 bool NanoCellular::connectNetwork()
 {
-    if (!sendAndCheckReply("AT+CFUN=1", _OK, 30000))
-    {
-        PN_ERROR("Failed disable airplane mode.");
-        return false;
-    }
-    return true;
+    PN_LOCK();
+    return attachNetwork();
 }
 
 bool NanoCellular::connectNetwork(const char* apn, const char* userId, const char* password)
 {
+    PN_LOCK();
     // First set up PDP context
     sprintf(_buffer, "AT+CGDCONT=0,\"IPV4V6\",\"%s\"", apn);
     if (!sendAndCheckReply(_buffer, _OK, 1000))
@@ -330,288 +418,2345 @@ bool NanoCellular::connectNetwork(const char* apn, const char* userId, const cha
         return false;
     }
     callWatchdog();
-    if (!sendAndCheckReply("AT+CFUN=1", _OK, 30000))
+    return attachNetwork();
+}
+
+bool NanoCellular::setSystemMode(SystemMode mode)
+{
+    PN_LOCK();
+    _systemMode = mode;
+    // Only accepted in airplane mode. Before begin() or with the radio
+    // on, the next attach applies it.
+    if (_uart == nullptr ||
+        _radioState != RadioState::Off)
     {
-        PN_ERROR("Failed disable airplane mode.");
-        return false;
+        PN_DEBUG("System mode applied on the next attach");
+        _systemModePending = true;
+        return true;
     }
+    return sendSystemMode();
+}
 
-    return true;
+bool NanoCellular::setBandLock(const uint8_t* bands, uint8_t count)
+{
+    PN_LOCK();
+    // Bands are kept as a bit mask, band 1 in bit 0
+    memset(_bandMask, 0, sizeof(_bandMask));
+    for (uint8_t i = 0; i < count; i++)
+    {
+        if (bands[i] == 0 || bands[i] > BAND_MASK_SIZE * 8)
+        {
+            PN_ERROR("Invalid band %i", bands[i]);
+            return false;
+        }
+        _bandMask[(bands[i] - 1) / 8] |= 1 << ((bands[i] - 1) % 8);
+    }
+    return sendBandLock(_bandMask);
 }
 
-int NanoCellular::read()
+bool NanoCellular::setOperator(const char* plmn)
 {
-    uint8_t buffer[2];
-    read(buffer, 1);
-    return buffer[0];
+    PN_LOCK();
+    if (plmn == nullptr)
+    {
+        _plmn[0] = 0;
+        return sendOperator(nullptr, 0);
+    }
+    strncpy(_plmn, plmn, sizeof(_plmn) - 1);
+    _plmn[sizeof(_plmn) - 1] = 0;
+    return sendOperator(_plmn, 1);
 }
 
-int NanoCellular::peek()
+void NanoCellular::setCellCache(const CellCache* cache)
 {
-    // Not supported
-    return 0;
+    PN_LOCK();
+    _cellCache = *cache;
 }
 
-int NanoCellular::read(uint8_t *buf, size_t size)
+void NanoCellular::getCellCache(CellCache* cache)
 {
-    if ((size == 0) || (_socket == 0))
+    PN_LOCK();
+    *cache = _cellCache;
+}
+
+bool NanoCellular::updateCellCache()
+{
+    PN_LOCK();
+    // Reply is:
+    // %XMONITOR: <reg_status>,<full_name>,<short_name>,<plmn>,<tac>,<AcT>,<band>,<cell_id>,...
+    // OK
+    if (!sendAndWaitForReply("AT%XMONITOR", 1000, 3))
     {
-        return 0;
+        return false;
     }
+    char* line = strstr(_buffer, "%XMONITOR: ");
+    return line != nullptr &&
+        parseMonitor(line);
+}
 
-    sprintf(_buffer, "AT#XTCPRECV=%i,%i,%i", _socket, size, SOCKET_TIMEOUT);
-    if (sendAndWaitForReply(_buffer, 1000, 1) &&
-        strstr(_buffer, "+QIRD:"))
-    {        
-        // +QIRD: <len>
-        // <data>
-        //
-        // OK
-        char* token = strtok(_buffer, " ");
-        token = strtok(nullptr, "\n");
-        char* ptr;
-        uint16_t length = strtol(token, &ptr, 10);
-        QT_COM_TRACE("Data len: %i", length);
-
-        _uart->readBytes(buf, length);
-        buf[length] = '\0';
-        QT_COM_TRACE_START(" <- ");
-        QT_COM_TRACE_ASCII(_buffer, size);
-        QT_COM_TRACE_END("");
-        return length;       
+bool NanoCellular::parseMonitor(char* line)
+{
+    // Also used on the reply to the AT%XMONITOR poll() leaves running
+    const char delimiter[] = ",";
+    char* token = strtok(line, delimiter);
+    for (uint8_t i = 0; i < 3 && token; i++)
+    {
+        token = strtok(nullptr, delimiter);
     }
-    return 0;
+    if (!token || strlen(token) < 7)
+    {
+        return false;
+    }
+    // Strip out the " characters
+    uint8_t len = strlen(token) - 2;
+    if (len >= sizeof(_cellCache.plmn))
+    {
+        return false;
+    }
+    strncpy(_cellCache.plmn, token + 1, len);
+    _cellCache.plmn[len] = 0;
+    token = strtok(nullptr, delimiter);
+    token = strtok(nullptr, delimiter);
+    token = strtok(nullptr, delimiter);
+    if (!token)
+    {
+        return false;
+    }
+    _cellCache.band = atoi(token);
+    token = strtok(nullptr, delimiter);
+    if (!token)
+    {
+        return false;
+    }
+    _cellCache.cellId = strtoul(token + 1, nullptr, 16);
+    _cellCache.valid = true;
+    PN_DEBUG("Cell cache: %s band %i cell %lx", _cellCache.plmn, _cellCache.band, (unsigned long)_cellCache.cellId);
+    return true;
 }
 
-int -NanoCellular::available()
-{
-    if (useEncryption())
-    {
-        if (sslLength > 0)
-        {
-            return sslLength;
-        }
-        sprintf(_buffer, "AT+QSSLRECV=1,%i", sizeof(_buffer) - 36);
-        if (sendAndWaitForReply(_buffer, 1000, 3))
-        {
-            char* recvToken = strstr(_buffer, "+QSSLRECV: ");
-			recvToken += 11;
-			
-            /* Get length of data */
-            char* lfToken = strstr(recvToken, "\n");
-			uint32_t llen = lfToken - recvToken;
-			
-			char numberStr[llen];
-			strncpy(numberStr, recvToken, llen);
-			numberStr[llen] = '\0';
-			
-			sslLength = atoi(numberStr);     
-
-			if (sslLength > 0)
-			{
-                //set start of data to after the last new line
-                char* data = lfToken + 1;
-
-                //The check below is because sometimes a URC-message gets through and ruins everything because it includes 2 more lines that we don't expect
-                //First cut off the message so we only check the first 30 characters
-                
-                //get first 30 characters
-                char subbuff[30];
-                memcpy( subbuff, _buffer, 30 );
-                subbuff[30] = '\0';
-
-                //A bad message can at a maximum look like this: +QSSLURC: "recv",1<LF><LF>+QSSLRECV: [number]<LF>
-                //but sometimes only part of it is included, example: v",1<LF><LF>+ QSSLRECV:[number]<LF>
-                //i check for 2 new lines before +QSSLRECV because if there only is 1 then the data will still be read
-                if(strstr(subbuff, "\n\n+QSSLRE") != nullptr) {
-                    if(readReply(1000, 2)) {
-                        data = _buffer;
-                    }
-                    else {
-                        QT_ERROR("Could not get data after URC-interrupt");
-
-                        sslLength = 0;
-                    }
-                }
+int NanoCellular::connect(IPAddress ip, uint16_t port)
+{
+    PN_LOCK();
+    char host[16];
+    sprintf(host, "%i.%i.%i.%i", ip[0], ip[1], ip[2], ip[3]);
+    return connect(host, port);
+}
 
-				memcpy(_readBuffer, data, sslLength);
-			}
-			QT_TRACE("available sslLength: %i", sslLength);
-			return sslLength;
-        }
+int NanoCellular::connect(const char *host, uint16_t port)
+{
+    PN_LOCK();
+    if (_socket != 0)
+    {
+        closeSocket();
     }
-    else
+    resetConnection();
+    if (host != _host)
     {
-        sprintf(_buffer, "AT+QIRD=1,0");
-        if (sendAndWaitForReply(_buffer, 1000, 3))
-        {
-            const char delimiter[] = ",";
-            char * token = strtok(_buffer, delimiter);              
-            if (token)
-            {
-                token = strtok(nullptr, delimiter);
-                if (token)
-                {
-                    token = strtok(nullptr, delimiter);
-                    if (token)
-                    {
-                        char* ptr;
-                        uint16_t unread = strtol(token, &ptr, 10);
-                        QT_COM_TRACE("Available: %i", unread);
-                        return unread;
-                    }
-                }
-            }        
-        }
+        strncpy(_host, host, HOST_NAME_SIZE - 1);
+        _host[HOST_NAME_SIZE - 1] = 0;
+        _port = port;
     }
-    QT_COM_ERROR("Failed to read response");
-    return 0;
-}
 
-//
-// Private
-//
+    // Reply is:
+    // #XSOCKET: <handle>,<type>,<protocol>
+    // OK
+    if (!sendAndWaitForReply("AT#XSOCKET=1,1,0", 1000, 3) ||
+        !strstr(_buffer, "#XSOCKET:"))
+    {
+        PN_ERROR("Failed to open socket");
+        checkResult(_buffer);
+        return 0;
+    }
+    char* token = strtok(_buffer, " ");
+    token = strtok(nullptr, ",");
+    if (!token)
+    {
+        return 0;
+    }
+    _socket = atoi(token);
 
-void NanoCellular::callWatchdog()
-{
-    if (watchdogcallback != nullptr)
+    // Reply is:
+    // #XTCPCONN: 1
+    // OK
+    sprintf(_buffer, "AT#XTCPCONN=%i,\"%s\",%u", _socket, host, port);
+    if (!sendAndWaitForReply(_buffer, 30000, 3) ||
+        !strstr(_buffer, "#XTCPCONN: 1"))
     {
-        (watchdogcallback)();
+        PN_ERROR("Failed to connect to %s:%u", host, port);
+        checkResult(_buffer);
+        // The host is kept, so the supervisor keeps trying
+        closeSocket();
+        return 0;
     }
+    return 1;
 }
 
-bool NanoCellular::setPower(bool state)
+void NanoCellular::stop()
 {
-    uint32_t timeout;
-	PN_DEBUG("setPower: %i", state);
-    if (state == true)
-    {
-        if (_powerPin != NOT_A_PIN)
-        {
-            digitalWrite(_powerPin, LOW);
-            delay(300);
-            digitalWrite(_powerPin, HIGH);
-        }
+    PN_LOCK();
+    // Closed on purpose, so the supervisor does not reopen it
+    _host[0] = 0;
+    closeSocket();
+}
 
-        PN_TRACE_START("Waiting for module");
-        while (!getStatus())
-        {
-            PN_TRACE_PART(".");
-            callWatchdog();
-            delay(500);
-        }
-        PN_TRACE_END("");
+uint8_t NanoCellular::connected()
+{
+    PN_LOCK();
+    return _socket != 0;
+}
 
-        PN_DEBUG("Open communications");
-        int32_t timeout = 7000;
-        while (timeout > 0) 
-        {
-            flush();
-            if (sendAndCheckReply(_AT, "AT", 1000))
-            {
-                PN_COM_TRACE("GOT AT");
-                break;
-            }
-            callWatchdog();
-            delay(500);
-            timeout -= 500;
-        }
+size_t NanoCellular::write(uint8_t c)
+{
+    PN_LOCK();
+    return write(&c, 1);
+}
 
-        if (timeout < 0)
-        {
-            PN_ERROR("Failed to initialize cellular module");
-            return false;
-        }
+size_t NanoCellular::write(const uint8_t *buf, size_t size)
+{
+    PN_LOCK();
+    // Bytes waiting in the transmit buffer were written first
+    if (buf != _txBuffer &&
+        !sendTx())
+    {
+        return 0;
     }
-    else
+    if (!drainSend())
     {
-        if (!getStatus())
+        return 0;
+    }
+    if (_lz == nullptr)
+    {
+        size_t sent = writeSocket(buf, size);
+        _stats.txPayloadBytes += sent;
+        return sent;
+    }
+
+    // Data is collected into blocks, a full block goes out as one
+    // compressed frame and flush() sends what is left
+    size_t taken = 0;
+    while (taken < size)
+    {
+        size_t length = LZ_BLOCK_SIZE - _lz->blockLength;
+        if (length > size - taken)
         {
-            PN_COM_TRACE("Module already off");
-            return true;
+            length = size - taken;
         }
-        PN_DEBUG("Powering down module");        
-        // First check if already awake
-        timeout = 5000;
-        while (timeout > 0) 
+        memcpy(_lz->block + _lz->blockLength, buf + taken, length);
+        _lz->blockLength += length;
+        taken += length;
+        if (_lz->blockLength == LZ_BLOCK_SIZE &&
+            !flushBlock())
         {
-            flush();
-            if (sendAndCheckReply(_AT, "OK", 1000))
-            {   
-                PN_COM_TRACE("GOT AT");
-                break;
-            }
-            if (sendAndCheckReply(_AT, "OK", 1000))
-            {   
-                PN_COM_TRACE("GOT OK");
-                break;
-            }            
-            callWatchdog();
-            delay(500);
-            timeout -= 500;
+            // Only count what went out before the failed block
+            return taken - length;
         }
-        sendAndCheckReply("ATE0", _OK, 1000);
-		
-        //if (!sendAndCheckReply("AT+QCFG=\"urc/port\",1,\"uart1\"", _OK))
-		if (!sendAndCheckReply("AT#URC=\"LWM2M\",1", _OK))
-		{
-			PN_ERROR("Could not start LWM2M urc messages");
-			return false;
-		}
-		if (!sendAndCheckReply("AT#URC=\"SOCK\",1", _OK))
-		{
-			PN_ERROR("Could not start SOCK urc messages");
-			return false;
-		}
+    }
+    return taken;
+}
 
-        if (!sendAndCheckReply("AT#SHUTDOWN", _OK, 10000))
+size_t NanoCellular::writeSocket(const uint8_t *buf, size_t size)
+{
+    size_t sent = 0;
+
+    if (_socket == 0)
+    {
+        return 0;
+    }
+
+    // Data is sent hex encoded, SOCKET_MAX_SEND bytes per command
+    // Reply is:
+    // #XTCPSEND: <size>
+    // OK
+    while (sent < size)
+    {
+        size_t chunk = size - sent;
+        if (chunk > SOCKET_MAX_SEND)
         {
-            return false;
+            chunk = SOCKET_MAX_SEND;
         }
-        timeout = millis() + 60000;  // max 60 seconds for a shutdown
-        while (timeout > millis())
+        formatSend(buf + sent, chunk);
+        if (!sendAndWaitForReply(_buffer, 5000, 3) ||
+            !strstr(_buffer, "#XTCPSEND:"))
         {
-            if (readReply(1000, 1))
+            PN_ERROR("Failed to send data");
+            // CME network errors are counted by checkResult(),
+            // anything else like a timeout is counted here
+            if (!checkResult(_buffer) &&
+                _lastError != 30 && _lastError != 31)
             {
-                if (strstr(_buffer, "+SHUTDOWN"))
-                {
-                    if (_powerPin != NOT_A_PIN)
-                    {
-                        digitalWrite(_powerPin, LOW);
-                    }
-                    PN_DEBUG("Module powered down");
-
-                    break;
-                }
+                _linkFailures++;
             }
-            callWatchdog();
+            break;
         }
-        return false;
+        _linkFailures = 0;
+        _stats.txSocketBytes += chunk;
+        _stats.connectionTxBytes += chunk;
+        sent += chunk;
+        callWatchdog();
     }
-    return true;
+    return sent;
 }
 
-bool NanoCellular::getSimPresent()
+int NanoCellular::read()
 {
-    // state is 0 if UICC not initialized or 1 if UICC initiailized
-    // Reply is:
-    // %XSIM: <state>
-    // OK
-    if (sendAndWaitForReply("AT%XSIM?"))
+    PN_LOCK();
+    uint8_t c;
+    if (read(&c, 1) <= 0)
     {
-        const char delimiter[] = " ";
-        char* token = strtok(_buffer, delimiter);
-        token = strtok(nullptr, delimiter);
-        if (token)
-        {
-            return token[0] == 0x31;
-        }        
+        return -1;
+    }
+    return c;
+}
+
+int NanoCellular::peek()
+{
+    // Not supported
+    return 0;
+}
+
+int NanoCellular::read(uint8_t *buf, size_t size)
+{
+    PN_LOCK();
+    if (_lz == nullptr)
+    {
+        int length = readSocket(buf, size);
+        _stats.rxPayloadBytes += length;
+        return length;
+    }
+
+    // Decode what is left from the last read first, and fetch at most
+    // one more buffer from the module per call
+    uint16_t produced = 0;
+    bool fetched = false;
+    while (produced < size)
+    {
+        if (_readOffset >= _readLength)
+        {
+            if (fetched)
+            {
+                break;
+            }
+            fetched = true;
+            int length = receiveSocket((uint8_t*)_readBuffer, sizeof(_readBuffer));
+            if (length <= 0)
+            {
+                break;
+            }
+            _readLength = length;
+            _readOffset = 0;
+        }
+        uint16_t consumed;
+        uint16_t decoded = _lz->decompress((uint8_t*)_readBuffer + _readOffset, _readLength - _readOffset,
+            &consumed, buf + produced, size - produced);
+        _readOffset += consumed;
+        produced += decoded;
+        if (decoded == 0 && consumed == 0)
+        {
+            break;
+        }
+    }
+    _stats.rxPayloadBytes += produced;
+    return produced;
+}
+
+uint8_t* NanoCellular::getTxBuffer(size_t* free)
+{
+    PN_LOCK();
+    if (_txLength >= SOCKET_TX_BUFFER &&
+        !flushTx())
+    {
+        *free = 0;
+        return nullptr;
+    }
+    *free = SOCKET_TX_BUFFER - _txLength;
+    return _txBuffer + _txLength;
+}
+
+bool NanoCellular::commitTx(size_t length)
+{
+    PN_LOCK();
+    if (length > SOCKET_TX_BUFFER - _txLength)
+    {
+        PN_ERROR("Commit of %i bytes exceeds the transmit buffer", (int)length);
+        return false;
+    }
+    _txLength += length;
+    return true;
+}
+
+bool NanoCellular::flushTx()
+{
+    PN_LOCK();
+    return sendTx() &&
+        flushBlock();
+}
+
+void NanoCellular::setCompression(NanoLz* lz)
+{
+    PN_LOCK();
+    // Both ends must start from empty windows, so switch before any data
+    flushBlock();
+    _lz = lz;
+    if (_lz != nullptr)
+    {
+        _lz->reset();
+    }
+}
+
+void NanoCellular::getStats(NanoStats* stats)
+{
+    PN_LOCK();
+    updateRadioTime();
+    *stats = _stats;
+#ifdef PICSIL_NANO_RTOS
+    stats->rxUartBytes += _readerRxBytes - _readerRxBase;
+#endif
+}
+
+void NanoCellular::resetStats()
+{
+    PN_LOCK();
+    memset(&_stats, 0, sizeof(_stats));
+#ifdef PICSIL_NANO_RTOS
+    _readerRxBase = _readerRxBytes;
+#endif
+    _radioTime = millis();
+    // Restarting collection clears the module counters
+    sendAndCheckReply("AT%XCONNSTAT=0", _OK, 1000);
+    sendAndCheckReply("AT%XCONNSTAT=1", _OK, 1000);
+}
+
+bool NanoCellular::updateModemStats()
+{
+    PN_LOCK();
+    // Reply is:
+    // %XCONNSTAT: <SMS Tx>,<SMS Rx>,<Data Tx>,<Data Rx>,<Packet max>,<Packet average>
+    // OK
+    if (sendAndWaitForReply("AT%XCONNSTAT?", 1000, 3))
+    {
+        char* token = strstr(_buffer, "%XCONNSTAT: ");
+        if (token)
+        {
+            char* ptr;
+            strtoul(token + 12, &ptr, 10);
+            strtoul(ptr + 1, &ptr, 10);
+            _stats.modemTxKBytes = strtoul(ptr + 1, &ptr, 10);
+            _stats.modemRxKBytes = strtoul(ptr + 1, &ptr, 10);
+            _stats.modemPacketMax = strtoul(ptr + 1, &ptr, 10);
+            _stats.modemPacketAverage = strtoul(ptr + 1, &ptr, 10);
+            return true;
+        }
+    }
+    return false;
+}
+
+float NanoCellular::getCompressionRatio()
+{
+    PN_LOCK();
+    uint32_t sent = _stats.txSocketBytes + _stats.rxSocketBytes;
+    if (sent == 0)
+    {
+        return 1.0;
+    }
+    return (float)(_stats.txPayloadBytes + _stats.rxPayloadBytes) / sent;
+}
+
+int NanoCellular::readSocket(uint8_t *buf, size_t size)
+{
+    // Data fetched by available() goes first
+    if (_readLength > _readOffset)
+    {
+        size_t length = _readLength - _readOffset;
+        if (length > size)
+        {
+            length = size;
+        }
+        memcpy(buf, _readBuffer + _readOffset, length);
+        _readOffset += length;
+        return length;
+    }
+    return receiveSocket(buf, size);
+}
+
+int NanoCellular::receiveSocket(uint8_t *buf, size_t size)
+{
+    if ((size == 0) || (_socket == 0))
+    {
+        return 0;
+    }
+    // Binary data comes hex encoded, two characters per byte in _buffer
+    if (size > SOCKET_MAX_RECV)
+    {
+        size = SOCKET_MAX_RECV;
+    }
+
+    // Reply is:
+    // <data>
+    // #XTCPRECV: <datatype>,<size>
+    // OK
+    // datatype 0 is a hex string, used when the data is not printable.
+    // Text data can hold line ends and anything else printable, so the
+    // reply is read as is and the data found by its size.
+    sprintf(_buffer, "AT#XTCPRECV=%i,%i,%i", _socket, (int)size, SOCKET_TIMEOUT);
+    flushInput();
+    sendCommand(_buffer);
+    readRawReply(SOCKET_TIMEOUT * 1000 + 1000);
+    char* info = nullptr;
+    for (char* next = strstr(_buffer, "\r\n#XTCPRECV: "); next; next = strstr(next + 1, "\r\n#XTCPRECV: "))
+    {
+        info = next;
+    }
+    if (!info)
+    {
+        checkResult(_buffer);
+        return 0;
+    }
+    char* ptr;
+    uint8_t type = strtol(info + 13, &ptr, 10);
+    size_t length = (*ptr == ',') ? strtoul(ptr + 1, nullptr, 10) : 0;
+    size_t encoded = (type == 0) ? length * 2 : length;
+    if (length > size ||
+        encoded > (size_t)(info - _buffer))
+    {
+        PN_COM_ERROR("Bad receive size %i", (int)length);
+        return 0;
+    }
+
+    // Anything before the data is URCs that came in ahead of the reply
+    char* data = info - encoded;
+    char first = *data;
+    *data = 0;
+    char* line = _buffer;
+    while (line < data)
+    {
+        char* end = strchr(line, '\n');
+        if (end)
+        {
+            *end = 0;
+        }
+        if (end > line && end[-1] == '\r')
+        {
+            end[-1] = 0;
+        }
+        if (isUrc(line))
+        {
+            PN_COM_TRACE(" <- (URC) %s", line);
+            processUrc(line);
+        }
+        if (!end)
+        {
+            break;
+        }
+        line = end + 1;
+    }
+    *data = first;
+
+    for (size_t i = 0; i < length; i++)
+    {
+        if (type == 0)
+        {
+            char hex[3] = { data[i * 2], data[i * 2 + 1], 0 };
+            buf[i] = strtoul(hex, nullptr, 16);
+        }
+        else
+        {
+            buf[i] = data[i];
+        }
+    }
+
+    PN_COM_TRACE("Data len: %i", (int)length);
+    _stats.rxSocketBytes += length;
+    _stats.connectionRxBytes += length;
+    PN_COM_TRACE_START(" <- ");
+    PN_COM_TRACE_BUFFER(buf, length);
+    PN_COM_TRACE_END("");
+    return length;
+}
+
+int NanoCellular::available()
+{
+    PN_LOCK();
+    if (_readLength > _readOffset)
+    {
+        return _readLength - _readOffset;
+    }
+    if (_socket == 0)
+    {
+        return 0;
+    }
+
+    // With the indicate pin wired, the module is only asked after it
+    // signalled, so an idle host sends nothing and can sleep
+    if (_indicatePin != NOT_A_PIN &&
+        !_dataPending)
+    {
+        return 0;
+    }
+    _dataPending = false;
+
+    int length = receiveSocket((uint8_t*)_readBuffer, sizeof(_readBuffer));
+    if (length <= 0)
+    {
+        return 0;
+    }
+    // A full buffer means the module may hold more
+    if (length == SOCKET_MAX_RECV)
+    {
+        _dataPending = true;
+    }
+    _readLength = length;
+    _readOffset = 0;
+    PN_COM_TRACE("Available: %i", length);
+    return length;
+}
+
+bool NanoCellular::isDataPending()
+{
+    return _dataPending ||
+        _readLength > _readOffset;
+}
+
+void NanoCellular::setSupervisor(bool enabled)
+{
+    PN_LOCK();
+    _supervise = enabled;
+    _recoveryStep = RecoveryStep::None;
+    _recoveryPhase = RecoveryPhase::Idle;
+    _recoveryBackoff = LINK_BACKOFF_MIN;
+}
+
+bool NanoCellular::checkLinkHealth()
+{
+    PN_LOCK();
+    // Only uses tracked state, poll() probes the registration
+    if (!isRegistered())
+    {
+        return false;
+    }
+    if (_host[0] &&
+        (!connected() || _linkFailures >= LINK_FAILURE_LIMIT))
+    {
+        return false;
+    }
+    return true;
+}
+
+bool NanoCellular::isLinkUp()
+{
+    PN_LOCK();
+    // Only uses tracked state, no commands are sent
+    return isRegistered() &&
+        (_host[0] == 0 || connected());
+}
+
+RecoveryStep NanoCellular::getRecoveryStep()
+{
+    PN_LOCK();
+    return _recoveryStep;
+}
+
+bool NanoCellular::startGnss(GnssMode mode, uint16_t interval, bool assistance, bool requestPsm)
+{
+    PN_LOCK();
+    if (!enableGnss())
+    {
+        return false;
+    }
+
+    // GNSS only runs while LTE is idle, PSM lets the modem sleep between
+    // transmissions so single and periodic fixes get their windows.
+    // Only requested when asked for, and undone by stopGnss().
+    // +CPSMS: <mode>[,...]
+    if (requestPsm &&
+        mode != GnssMode::Continuous &&
+        !_gnssPsm &&
+        sendAndWaitForReply("AT+CPSMS?") &&
+        strstr(_buffer, "+CPSMS: 0"))
+    {
+        if (sendAndCheckReply("AT+CPSMS=1", _OK, 1000))
+        {
+            _gnssPsm = true;
+        }
+        else
+        {
+            PN_DEBUG("Failed to request PSM, fixes may be delayed");
+        }
+    }
+
+    // The modem keeps ephemerides between fixes, only download
+    // assistance data when it is missing or too old to be useful
+    bool assist = assistance &&
+        (!_assistanceValid || millis() - _assistanceTime > GNSS_ASSISTANCE_VALIDITY);
+
+    // #XGPS=<op>,<cloud_assistance>,<interval>[,<timeout>]
+    // interval is 0 for a single fix, 1 for continuous, else seconds
+    switch (mode)
+    {
+        case GnssMode::Single:
+            sprintf(_buffer, "AT#XGPS=1,%i,0,%i", assist, GNSS_FIX_TIMEOUT);
+            break;
+        case GnssMode::Periodic:
+            sprintf(_buffer, "AT#XGPS=1,%i,%u,%i", assist, interval < 10 ? 10 : interval, GNSS_FIX_TIMEOUT);
+            break;
+        case GnssMode::Continuous:
+            sprintf(_buffer, "AT#XGPS=1,%i,1", assist);
+            break;
+    }
+    if (!sendAndCheckReply(_buffer, _OK, 5000))
+    {
+        PN_ERROR("Failed to start GNSS");
+        return false;
+    }
+    if (assist)
+    {
+        _assistanceValid = true;
+        _assistanceTime = millis();
+    }
+    return true;
+}
+
+bool NanoCellular::stopGnss()
+{
+    PN_LOCK();
+    if (!sendAndCheckReply("AT#XGPS=0", _OK, 5000))
+    {
+        return false;
+    }
+    // Only turn PSM off again if startGnss() turned it on
+    if (_gnssPsm &&
+        sendAndCheckReply("AT+CPSMS=0", _OK, 1000))
+    {
+        _gnssPsm = false;
+    }
+    return true;
+}
+
+bool NanoCellular::getLastFix(GnssFix* fix)
+{
+    PN_LOCK();
+    if (!_fixValid)
+    {
+        return false;
+    }
+    *fix = _lastFix;
+    return true;
+}
+
+bool NanoCellular::startFota(const char* url)
+{
+    PN_LOCK();
+    if (strlen(url) >= FOTA_URL_SIZE)
+    {
+        PN_ERROR("FOTA url too long");
+        return false;
+    }
+    strcpy(_fotaUrl, url);
+    _fotaProgress = 0;
+    if (!sendFota())
+    {
+        PN_ERROR("Failed to start FOTA");
+        setFotaStage(FotaStage::Failed);
+        return false;
+    }
+    setFotaStage(FotaStage::Downloading);
+    return true;
+}
+
+bool NanoCellular::resumeFota()
+{
+    PN_LOCK();
+    if (_fotaStage != FotaStage::Paused)
+    {
+        return false;
+    }
+
+    // Starting again with the same url makes the modem continue from
+    // the offset it has stored, so the progress so far is kept
+    PN_DEBUG("Resuming FOTA at %i%%", _fotaProgress);
+    if (!sendFota())
+    {
+        // Refused, stays paused and poll() tries again after
+        // FOTA_RETRY_INTERVAL
+        PN_DEBUG("FOTA resume not accepted");
+        _fotaTime = millis();
+        return false;
+    }
+    setFotaStage(FotaStage::Downloading);
+    return true;
+}
+
+bool NanoCellular::cancelFota()
+{
+    PN_LOCK();
+    if (!sendAndCheckReply("AT#XFOTA=0", _OK, 5000))
+    {
+        return false;
+    }
+    setFotaStage(FotaStage::Idle);
+    return true;
+}
+
+bool NanoCellular::applyFota()
+{
+    PN_LOCK();
+    if (_fotaStage != FotaStage::Downloaded)
+    {
+        return false;
+    }
+
+    char previousVersion[sizeof(_firmwareVersion)];
+    strcpy(previousVersion, _firmwareVersion);
+
+    // The update is applied while the modem restarts
+    PN_DEBUG("Restarting module to apply update");
+    setPower(false);
+    bool powered = setPower(true);
+    // The socket did not survive the restart
+    _socket = 0;
+    if (!powered ||
+        !refreshFirmwareVersion())
+    {
+        setFotaStage(FotaStage::Failed);
+        return false;
+    }
+    if (strcmp(previousVersion, _firmwareVersion) == 0)
+    {
+        PN_ERROR("Firmware version unchanged after update: %s", _firmwareVersion);
+        setFotaStage(FotaStage::Failed);
+        return false;
+    }
+    PN_INFO("Firmware updated to %s", _firmwareVersion);
+    setFotaStage(FotaStage::Verified);
+    return true;
+}
+
+FotaStage NanoCellular::getFotaStage()
+{
+    PN_LOCK();
+    return _fotaStage;
+}
+
+uint8_t NanoCellular::getFotaProgress()
+{
+    PN_LOCK();
+    return _fotaProgress;
+}
+
+bool NanoCellular::refreshFirmwareVersion()
+{
+    PN_LOCK();
+    // Reply is:
+    // mfw_nrf9160_1.2.3
+    // OK
+    if (sendAndWaitForReply("AT+CGMR", 1000, 3) &&
+        strstr(_buffer, _OK))
+    {
+        char* lf = strchr(_buffer, '\n');
+        if (lf)
+        {
+            uint8_t len = lf - _buffer;
+            if (len >= sizeof(_firmwareVersion))
+            {
+                len = sizeof(_firmwareVersion) - 1;
+            }
+            strncpy(_firmwareVersion, _buffer, len);
+            _firmwareVersion[len] = 0;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool NanoCellular::queueRecord(const uint8_t* data, uint8_t length)
+{
+    PN_LOCK();
+    uint16_t dropped = _queue.getDropped();
+    if (!_queue.push(data, length))
+    {
+        return false;
+    }
+    // Making room drops the oldest records, which may belong to the
+    // batch being sent. Those must not be removed again once it is done.
+    dropped = _queue.getDropped() - dropped;
+    _batchRecords = dropped < _batchRecords ? _batchRecords - dropped : 0;
+    return true;
+}
+
+uint16_t NanoCellular::getQueuedRecords()
+{
+    PN_LOCK();
+    return _queue.count();
+}
+
+uint16_t NanoCellular::getDroppedRecords()
+{
+    PN_LOCK();
+    return _queue.getDropped();
+}
+
+void NanoCellular::setQueueStorage(NanoQueueStorage* storage)
+{
+    PN_LOCK();
+    _queue.setStorage(storage);
+}
+
+void NanoCellular::setQueueCompactCallback(QUEUE_COMPACT_CALLBACK_SIGNATURE)
+{
+    PN_LOCK();
+    this->compactcallback = compactcallback;
+}
+
+void NanoCellular::setFotaCallback(FOTA_CALLBACK_SIGNATURE)
+{
+    PN_LOCK();
+    this->fotacallback = fotacallback;
+}
+
+void NanoCellular::setGnssCallback(GNSS_CALLBACK_SIGNATURE)
+{
+    PN_LOCK();
+    this->gnsscallback = gnsscallback;
+}
+
+bool NanoCellular::flushQueue()
+{
+    PN_LOCK();
+    if (!connected())
+    {
+        return false;
+    }
+
+    if (!flushTx())
+    {
+        return false;
+    }
+
+    // Same sends as poll(), waiting for each reply in turn
+    if (_pending != PendingCommand::Send)
+    {
+        finishCommand();
+    }
+    while (_pending == PendingCommand::Send || startSend())
+    {
+        if (!finishCommand())
+        {
+            return false;
+        }
+        callWatchdog();
+    }
+    return true;
+}
+
+void NanoCellular::poll()
+{
+    PN_LOCK();
+    // Nothing else is sent while a command waits for its reply,
+    // so poll() returns straight away until it is done
+    if (_pending != PendingCommand::None)
+    {
+        serviceCommand();
+    }
+    if (_pending != PendingCommand::None)
+    {
+        return;
+    }
+
+    while (readUrc())
+    {
+        callWatchdog();
+    }
+
+    superviseLink();
+    if (_pending != PendingCommand::None ||
+        _recoveryPhase != RecoveryPhase::Idle)
+    {
+        return;
+    }
+
+    if (_cellCacheStale &&
+        isRegistered())
+    {
+        // Reply is picked up by commandLine()
+        startCommand(PendingCommand::CellCache, "AT%XMONITOR", 1000);
+        return;
+    }
+
+    // The firmware has no status query, so a download that went quiet
+    // is resumed, which either continues it or reports it complete.
+    // This catches #XFOTA URCs that got lost.
+    if (_fotaStage == FotaStage::Downloading &&
+        millis() - _fotaTime >= FOTA_STALL_TIMEOUT)
+    {
+        PN_DEBUG("No FOTA progress reported, checking download");
+        setFotaStage(FotaStage::Paused);
+    }
+
+    if (_fotaStage == FotaStage::Paused &&
+        isRegistered() &&
+        millis() - _fotaTime >= FOTA_RETRY_INTERVAL)
+    {
+        // Same as resumeFota(), endCommand() takes the reply
+        PN_DEBUG("Resuming FOTA at %i%%", _fotaProgress);
+        formatFota();
+        startCommand(PendingCommand::Fota, _buffer, 5000);
+        return;
+    }
+
+    // Starts the next queue send without waiting for the reply,
+    // the retry interval only applies after a failed send. Records
+    // wait while a message is still being put in the transmit buffer,
+    // or while written data sits in a partial block until flush().
+    if (_txLength == 0 &&
+        (_lz == nullptr || _lz->blockLength == 0) &&
+        isRegistered() &&
+        connected() &&
+        millis() - _queueAttempt >= QUEUE_RETRY_INTERVAL)
+    {
+        startSend();
+    }
+}
+
+//
+// Private
+//
+
+void NanoCellular::attachIndicate()
+{
+    static void (*const isr[INDICATE_MAX_INSTANCES])() =
+    {
+        indicateIsr0, indicateIsr1, indicateIsr2, indicateIsr3
+    };
+
+    if (_indicatePin == NOT_A_PIN)
+    {
+        return;
+    }
+    int interrupt = digitalPinToInterrupt(_indicatePin);
+#ifdef NOT_AN_INTERRUPT
+    if (interrupt == NOT_AN_INTERRUPT)
+    {
+        PN_ERROR("Indicate pin %i has no interrupt, polling instead", _indicatePin);
+        _indicatePin = NOT_A_PIN;
+        return;
+    }
+#endif
+    for (uint8_t i = 0; i < INDICATE_MAX_INSTANCES; i++)
+    {
+        if (_indicateInstances[i] == this)
+        {
+            return;
+        }
+        if (_indicateInstances[i] == nullptr)
+        {
+            _indicateInstances[i] = this;
+            // The module pulls the pin low when it has data or a URC,
+            // start out pending so nothing sent before now is missed
+            _dataPending = true;
+            attachInterrupt(interrupt, isr[i], FALLING);
+            return;
+        }
+    }
+    PN_ERROR("No free indicate interrupt, polling instead");
+    _indicatePin = NOT_A_PIN;
+}
+
+void NanoCellular::indicateIsr0()
+{
+    _indicateInstances[0]->_dataPending = true;
+}
+
+void NanoCellular::indicateIsr1()
+{
+    _indicateInstances[1]->_dataPending = true;
+}
+
+void NanoCellular::indicateIsr2()
+{
+    _indicateInstances[2]->_dataPending = true;
+}
+
+void NanoCellular::indicateIsr3()
+{
+    _indicateInstances[3]->_dataPending = true;
+}
+
+bool NanoCellular::isRegistered()
+{
+    return _registration == NetworkRegistrationState::Registered ||
+        _registration == NetworkRegistrationState::Roaming;
+}
+
+void NanoCellular::configureModule()
+{
+    for (uint8_t i = 0; i < CONFIG_COMMANDS; i++)
+    {
+        sendAndCheckReply(configCommands[i], _OK, 1000);
+    }
+    refreshFirmwareVersion();
+    // Seed the recovery jitter from the IMEI, or modules powered up
+    // together would all draw the same delays
+    if (sendAndWaitForReply("AT+CGSN"))
+    {
+        uint32_t seed = micros();
+        for (const char* c = _buffer; *c; c++)
+        {
+            seed = seed * 31 + *c;
+        }
+        randomSeed(seed);
+    }
+}
+
+bool NanoCellular::attachNetwork()
+{
+    // A system mode set while the radio was on needs airplane mode
+    if (_systemModePending)
+    {
+        if (_radioState != RadioState::Off)
+        {
+            disconnectNetwork();
+        }
+        sendSystemMode();
+    }
+
+    // With a cached cell, only scan its band and prefer its operator
+    // (manual with automatic fallback) for the first part of the attach
+    bool biased = false;
+    if (_cellCache.valid &&
+        _cellCache.band > 0 &&
+        _cellCache.band <= BAND_MASK_SIZE * 8)
+    {
+        uint8_t mask[BAND_MASK_SIZE];
+        memset(mask, 0, sizeof(mask));
+        mask[(_cellCache.band - 1) / 8] = 1 << ((_cellCache.band - 1) % 8);
+        biased = sendBandLock(mask) &&
+            sendOperator(_cellCache.plmn, 4);
+    }
+
+    _registration = NetworkRegistrationState::NotRegistered;
+    if (!sendAndCheckReply("AT+CFUN=1", _OK, 30000))
+    {
+        PN_ERROR("Failed disable airplane mode.");
+        return false;
+    }
+    setRadioState(RadioState::On);
+
+    if (biased)
+    {
+        if (!waitForRegistration(CELL_CACHE_TIMEOUT))
+        {
+            PN_DEBUG("Cached cell not found, scanning all bands");
+            _cellCache.valid = false;
+        }
+        // The bias is only for this attach, later cell changes and
+        // reattaches use the configured bands and operator again
+        sendBandLock(_bandMask);
+        sendOperator(_plmn, _plmn[0] ? 1 : 0);
+    }
+    _cellCacheStale = true;
+    return true;
+}
+
+bool NanoCellular::sendSystemMode()
+{
+    formatSystemMode();
+    if (!sendAndCheckReply(_buffer, _OK, 1000))
+    {
+        PN_ERROR("Failed to set system mode");
+        return false;
+    }
+    _systemModePending = false;
+    return true;
+}
+
+bool NanoCellular::sendBandLock(const uint8_t* mask)
+{
+    formatBandLock(mask);
+    if (!sendAndCheckReply(_buffer, _OK, 1000))
+    {
+        PN_ERROR("Failed to set band lock");
+        return false;
+    }
+    return true;
+}
+
+bool NanoCellular::sendOperator(const char* plmn, uint8_t mode)
+{
+    formatOperator(plmn, mode);
+    if (!sendAndCheckReply(_buffer, _OK, 5000))
+    {
+        PN_ERROR("Failed to select operator");
+        return false;
+    }
+    return true;
+}
+
+void NanoCellular::formatSystemMode()
+{
+    // %XSYSTEMMODE=<LTE_M>,<NB_IoT>,<GNSS>,<LTE_preference>
+    // Only accepted in airplane mode
+    sprintf(_buffer, "AT%%XSYSTEMMODE=%i,%i,%i,0",
+        _systemMode != SystemMode::NbIot,
+        _systemMode != SystemMode::LteM,
+        _gnssEnabled);
+}
+
+void NanoCellular::formatBandLock(const uint8_t* mask)
+{
+    // The mask is a string of bits with band 1 last, up to the highest
+    // band used. Runtime locks (operation 2) are not written to NVM.
+    int8_t highest = -1;
+    for (uint8_t band = 0; band < BAND_MASK_SIZE * 8; band++)
+    {
+        if (mask[band / 8] & (1 << (band % 8)))
+        {
+            highest = band;
+        }
+    }
+    if (highest < 0)
+    {
+        strcpy(_buffer, "AT%XBANDLOCK=0");
+        return;
+    }
+
+    int len = sprintf(_buffer, "AT%%XBANDLOCK=2,\"");
+    for (int8_t band = highest; band >= 0; band--)
+    {
+        _buffer[len++] = (mask[band / 8] & (1 << (band % 8))) ? '1' : '0';
+    }
+    _buffer[len++] = '"';
+    _buffer[len] = 0;
+}
+
+void NanoCellular::formatOperator(const char* plmn, uint8_t mode)
+{
+    // Mode 0 is automatic, 1 manual and 4 manual with automatic fallback
+    if (mode == 0)
+    {
+        strcpy(_buffer, "AT+COPS=0");
+    }
+    else
+    {
+        sprintf(_buffer, "AT+COPS=%i,2,\"%s\"", mode, plmn);
+    }
+}
+
+bool NanoCellular::waitForRegistration(uint32_t timeout)
+{
+    // Registration URCs are cheaper than polling AT+CEREG?
+    uint32_t start = millis();
+    while (millis() - start < timeout)
+    {
+        readUrc();
+        if (isRegistered())
+        {
+            return true;
+        }
+        callWatchdog();
+        delay(10);
+    }
+    return false;
+}
+
+void NanoCellular::superviseLink()
+{
+    if (!_supervise)
+    {
+        return;
+    }
+    if (_recoveryPhase != RecoveryPhase::Idle)
+    {
+        serviceRecovery();
+        return;
+    }
+    if (_recoveryStep != RecoveryStep::None &&
+        millis() - _recoveryTime < _recoveryWait)
+    {
+        return;
+    }
+    // Registration is tracked through URCs, the module is only asked
+    // now and then in case one was missed. The health is checked once
+    // commandLine() has the reply.
+    if (millis() - _probeTime >= LINK_PROBE_INTERVAL)
+    {
+        _probeTime = millis();
+        startCommand(PendingCommand::Probe, "AT+CEREG?", 1000);
+        return;
+    }
+
+    if (checkLinkHealth())
+    {
+        if (_recoveryStep != RecoveryStep::None)
+        {
+            PN_INFO("Link recovered");
+            _recoveryStep = RecoveryStep::None;
+            _recoveryBackoff = LINK_BACKOFF_MIN;
+        }
+        return;
+    }
+
+    // Escalate one step per attempt. Reopening the socket is pointless
+    // without registration, and the last step is repeated until it works.
+    RecoveryStep step = _recoveryStep;
+    if (step == RecoveryStep::None)
+    {
+        step = (_host[0] && isRegistered()) ? RecoveryStep::ReopenSocket : RecoveryStep::CycleRadio;
+    }
+    else
+    {
+        if (step != RecoveryStep::PowerCycle)
+        {
+            step = (RecoveryStep)((uint8_t)step + 1);
+        }
+        _recoveryBackoff *= 2;
+        if (_recoveryBackoff > LINK_BACKOFF_MAX)
+        {
+            _recoveryBackoff = LINK_BACKOFF_MAX;
+        }
+    }
+
+    // +/-25% jitter keeps a fleet from retrying in lockstep after an outage
+    _recoveryWait = _recoveryBackoff - _recoveryBackoff / 4 + random(_recoveryBackoff / 2);
+    _recoveryStep = step;
+    PN_INFO("Link down, recovery step %i", (uint8_t)step);
+    startRecovery(step);
+}
+
+void NanoCellular::startRecovery(RecoveryStep step)
+{
+    _linkFailures = 0;
+    _recoveryFailed = false;
+    switch (step)
+    {
+        case RecoveryStep::ReopenSocket:
+            setPhase(_socket != 0 ? RecoveryPhase::CloseSocket : RecoveryPhase::OpenSocket);
+            break;
+        case RecoveryStep::CycleRadio:
+            setPhase(RecoveryPhase::RadioOff);
+            break;
+        case RecoveryStep::PowerCycle:
+            setPhase(RecoveryPhase::Shutdown);
+            break;
+        default:
+            return;
+    }
+    serviceRecovery();
+}
+
+void NanoCellular::serviceRecovery()
+{
+    // Starts the command of the current phase, or checks the pin or
+    // timer it waits on. Replies end the phase through endPhase().
+    if (_pending != PendingCommand::None)
+    {
+        return;
+    }
+    switch (_recoveryPhase)
+    {
+        case RecoveryPhase::Shutdown:
+            if (_phaseActive)
+            {
+                break;
+            }
+            if (!getStatus())
+            {
+                setPhase(RecoveryPhase::PowerOn);
+                break;
+            }
+            // Neither the socket nor GNSS assistance data survive this
+            _socket = 0;
+            _assistanceValid = false;
+            _phaseActive = startCommand(PendingCommand::Recovery, "AT#SHUTDOWN", POWER_OFF_TIMEOUT, "+SHUTDOWN");
+            break;
+        case RecoveryPhase::PowerOn:
+            // Same pulse as setPower(true)
+            if (!_phaseActive)
+            {
+                if (_powerPin != NOT_A_PIN)
+                {
+                    digitalWrite(_powerPin, LOW);
+                }
+                _phaseActive = true;
+            }
+            else if (millis() - _phaseTime >= POWER_PULSE_TIME)
+            {
+                if (_powerPin != NOT_A_PIN)
+                {
+                    digitalWrite(_powerPin, HIGH);
+                }
+                setPhase(RecoveryPhase::Wake);
+            }
+            break;
+        case RecoveryPhase::Wake:
+            if (millis() - _phaseTime >= LINK_ATTACH_TIMEOUT)
+            {
+                PN_ERROR("Module did not restart");
+                endRecovery(false);
+            }
+            else if (getStatus())
+            {
+                _phaseActive = startCommand(PendingCommand::Recovery, _AT, 1000);
+            }
+            break;
+        case RecoveryPhase::Configure:
+            _phaseActive = startCommand(PendingCommand::Recovery, configCommands[_configIndex], 1000);
+            break;
+        case RecoveryPhase::RadioOff:
+            _phaseActive = startCommand(PendingCommand::Recovery, "AT+CFUN=4", 30000);
+            break;
+        case RecoveryPhase::SystemMode:
+            formatSystemMode();
+            _phaseActive = startCommand(PendingCommand::Recovery, _buffer, 1000);
+            break;
+        case RecoveryPhase::BandLock:
+            formatBandLock(_bandMask);
+            _phaseActive = startCommand(PendingCommand::Recovery, _buffer, 1000);
+            break;
+        case RecoveryPhase::Operator:
+            formatOperator(_plmn, _plmn[0] ? 1 : 0);
+            _phaseActive = startCommand(PendingCommand::Recovery, _buffer, 5000);
+            break;
+        case RecoveryPhase::RadioOn:
+            _registration = NetworkRegistrationState::NotRegistered;
+            _phaseActive = startCommand(PendingCommand::Recovery, "AT+CFUN=1", 30000);
+            break;
+        case RecoveryPhase::Register:
+            // Registration URCs are read by poll()
+            if (isRegistered())
+            {
+                if (_host[0] == 0)
+                {
+                    endRecovery(true);
+                }
+                else
+                {
+                    setPhase(_socket != 0 ? RecoveryPhase::CloseSocket : RecoveryPhase::OpenSocket);
+                }
+            }
+            else if (millis() - _phaseTime >= LINK_ATTACH_TIMEOUT)
+            {
+                endRecovery(false);
+            }
+            else if (millis() - _probeTime >= LINK_PROBE_INTERVAL)
+            {
+                _probeTime = millis();
+                startCommand(PendingCommand::Probe, "AT+CEREG?", 1000);
+            }
+            break;
+        case RecoveryPhase::CloseSocket:
+            sprintf(_buffer, "AT#XSOCKET=0,%i", _socket);
+            _phaseActive = startCommand(PendingCommand::Recovery, _buffer, 5000);
+            break;
+        case RecoveryPhase::OpenSocket:
+            resetConnection();
+            _phaseActive = startCommand(PendingCommand::Recovery, "AT#XSOCKET=1,1,0", 1000);
+            break;
+        case RecoveryPhase::ConnectSocket:
+            sprintf(_buffer, "AT#XTCPCONN=%i,\"%s\",%u", _socket, _host, _port);
+            _phaseActive = startCommand(PendingCommand::Recovery, _buffer, 30000);
+            break;
+        default:
+            break;
+    }
+}
+
+void NanoCellular::endPhase(bool ok)
+{
+    switch (_recoveryPhase)
+    {
+        case RecoveryPhase::Shutdown:
+            if (_powerPin != NOT_A_PIN)
+            {
+                digitalWrite(_powerPin, LOW);
+            }
+            setRadioState(RadioState::Off);
+            setPhase(RecoveryPhase::PowerOn);
+            break;
+        case RecoveryPhase::Wake:
+            if (!ok)
+            {
+                // Asked again on the next poll() until LINK_ATTACH_TIMEOUT
+                _phaseActive = false;
+                break;
+            }
+            // The module starts with the radio on, radio time counts from here
+            setRadioState(RadioState::On);
+            _configIndex = 0;
+            setPhase(RecoveryPhase::Configure);
+            break;
+        case RecoveryPhase::Configure:
+            if (++_configIndex < CONFIG_COMMANDS)
+            {
+                _phaseActive = false;
+                break;
+            }
+            setPhase(RecoveryPhase::RadioOff);
+            break;
+        case RecoveryPhase::RadioOff:
+            if (ok)
+            {
+                setRadioState(RadioState::Off);
+            }
+            setPhase(RecoveryPhase::SystemMode);
+            break;
+        case RecoveryPhase::SystemMode:
+            if (ok)
+            {
+                _systemModePending = false;
+            }
+            setPhase(RecoveryPhase::BandLock);
+            break;
+        case RecoveryPhase::BandLock:
+            setPhase(RecoveryPhase::Operator);
+            break;
+        case RecoveryPhase::Operator:
+            setPhase(RecoveryPhase::RadioOn);
+            break;
+        case RecoveryPhase::RadioOn:
+            if (!ok)
+            {
+                PN_ERROR("Failed disable airplane mode.");
+                endRecovery(false);
+                break;
+            }
+            setRadioState(RadioState::On);
+            _cellCacheStale = true;
+            setPhase(RecoveryPhase::Register);
+            break;
+        case RecoveryPhase::CloseSocket:
+            _socket = 0;
+            if (_recoveryFailed ||
+                _host[0] == 0)
+            {
+                endRecovery(!_recoveryFailed);
+                break;
+            }
+            setPhase(RecoveryPhase::OpenSocket);
+            break;
+        case RecoveryPhase::OpenSocket:
+            if (!ok ||
+                _socket == 0)
+            {
+                PN_ERROR("Failed to open socket");
+                endRecovery(false);
+                break;
+            }
+            setPhase(RecoveryPhase::ConnectSocket);
+            break;
+        case RecoveryPhase::ConnectSocket:
+            if (!ok ||
+                !_pendingResult)
+            {
+                // The handle is closed before giving up on it
+                PN_ERROR("Failed to connect to %s:%u", _host, _port);
+                _recoveryFailed = true;
+                setPhase(RecoveryPhase::CloseSocket);
+                break;
+            }
+            endRecovery(true);
+            break;
+        default:
+            break;
+    }
+}
+
+void NanoCellular::setPhase(RecoveryPhase phase)
+{
+    _recoveryPhase = phase;
+    _phaseTime = millis();
+    _phaseActive = false;
+}
+
+void NanoCellular::endRecovery(bool ok)
+{
+    PN_DEBUG("Recovery step %i %s", (uint8_t)_recoveryStep, ok ? "done" : "failed");
+    _recoveryPhase = RecoveryPhase::Idle;
+    // The backoff counts from the end of the step
+    _recoveryTime = millis();
+    if (ok)
+    {
+        // Confirmed healthy on the next call
+        _recoveryWait = 0;
+    }
+}
+
+void NanoCellular::formatSend(const uint8_t* data, size_t length)
+{
+    // Data is sent hex encoded, at most SOCKET_MAX_SEND bytes
+    const char hex[] = "0123456789ABCDEF";
+    int len = sprintf(_buffer, "AT#XTCPSEND=%i,0,\"", _socket);
+    for (size_t i = 0; i < length; i++)
+    {
+        _buffer[len++] = hex[data[i] >> 4];
+        _buffer[len++] = hex[data[i] & 0x0F];
+    }
+    _buffer[len++] = '"';
+    _buffer[len] = 0;
+}
+
+bool NanoCellular::loadWire()
+{
+    // The wire holds the next part of the batch as it goes out,
+    // a compressed frame or the batch bytes themselves
+    while (_batchTaken >= _batchLength)
+    {
+        if (_queue.count() == 0)
+        {
+            return false;
+        }
+        _batchLength = _queue.fill(_queueBatch, QUEUE_BATCH_SIZE, &_batchRecords);
+        if (_batchRecords == 0)
+        {
+            PN_ERROR("Queued record does not fit in a batch");
+            _queue.remove(1);
+            _batchLength = 0;
+            return false;
+        }
+        if (compactcallback != nullptr)
+        {
+            // Compacting can only shrink the batch, it is sent from
+            // the buffer it was filled into
+            uint16_t length = (compactcallback)(_queueBatch, _batchLength, _batchRecords);
+            if (length > _batchLength)
+            {
+                PN_ERROR("Compacted batch larger than filled, %i of %i bytes", length, _batchLength);
+                length = _batchLength;
+            }
+            _batchLength = length;
+        }
+        _batchTaken = 0;
+        if (_batchLength == 0)
+        {
+            // Nothing left to send, the records are done with
+            PN_DEBUG("%i queued records compacted away", _batchRecords);
+            _queue.remove(_batchRecords);
+            _batchRecords = 0;
+            continue;
+        }
+        PN_DEBUG("Sending %i queued records, %i bytes", _batchRecords, _batchLength);
+    }
+
+    uint16_t block = _batchLength - _batchTaken;
+    if (_lz != nullptr)
+    {
+        if (block > LZ_BLOCK_SIZE)
+        {
+            block = LZ_BLOCK_SIZE;
+        }
+        _wireLength = _lz->compress(_queueBatch + _batchTaken, block, _lz->frame);
+        _wire = _lz->frame;
+    }
+    else
+    {
+        _wireLength = block;
+        _wire = _queueBatch + _batchTaken;
+    }
+    _batchTaken += block;
+    _wireSent = 0;
+    _stats.txPayloadBytes += block;
+    return true;
+}
+
+bool NanoCellular::startSend()
+{
+    if (_pending != PendingCommand::None ||
+        _socket == 0)
+    {
+        return false;
+    }
+    if (_wireSent >= _wireLength &&
+        !loadWire())
+    {
+        return false;
+    }
+
+    // Reply is:
+    // #XTCPSEND: <size>
+    // OK
+    // collected by serviceCommand() as it arrives
+    _sendChunk = _wireLength - _wireSent;
+    if (_sendChunk > SOCKET_MAX_SEND)
+    {
+        _sendChunk = SOCKET_MAX_SEND;
+    }
+    formatSend(_wire + _wireSent, _sendChunk);
+    return startCommand(PendingCommand::Send, _buffer, SOCKET_SEND_TIMEOUT);
+}
+
+bool NanoCellular::startCommand(PendingCommand command, const char* text, uint32_t timeout, const char* reply)
+{
+    // Sends without waiting for the reply. The command ends with OK, or
+    // with a line holding reply when one is given, and serviceCommand()
+    // picks that up on later calls.
+    if (_pending != PendingCommand::None)
+    {
+        return false;
+    }
+    flushInput();
+    sendCommand(text);
+    _urcIndex = 0;
+    _pending = command;
+    _pendingTime = millis();
+    _pendingTimeout = timeout;
+    _pendingReply = reply;
+    // Set by commandLine() when the reply carries what was asked for
+    _pendingResult = false;
+    return true;
+}
+
+bool NanoCellular::serviceCommand()
+{
+    // Returns false once the command in progress has failed. This runs
+    // from flushInput() after callers put their next command in _buffer,
+    // so replies are only collected in _urcBuffer.
+    while (_pending != PendingCommand::None &&
+        uartAvailable())
+    {
+        char c = uartRead();
+        if (c == '\r')
+        {
+            continue;
+        }
+        if (c != '\n')
+        {
+            if (_urcIndex < URC_BUFFER_SIZE - 1)
+            {
+                _urcBuffer[_urcIndex++] = c;
+            }
+            continue;
+        }
+        if (_urcIndex == 0)
+        {
+            continue;
+        }
+        _urcBuffer[_urcIndex] = 0;
+        _urcIndex = 0;
+        PN_COM_TRACE(" <- %s", _urcBuffer);
+        if (isUrc(_urcBuffer))
+        {
+            processUrc(_urcBuffer);
+        }
+        else if (strstr(_urcBuffer, "ERROR"))
+        {
+            checkResult(_urcBuffer);
+            endCommand(false);
+            return false;
+        }
+        else if (_pendingReply != nullptr)
+        {
+            if (strstr(_urcBuffer, _pendingReply))
+            {
+                endCommand(true);
+            }
+        }
+        else if (strcmp(_urcBuffer, _OK) == 0)
+        {
+            endCommand(true);
+        }
+        else
+        {
+            commandLine(_urcBuffer);
+        }
+    }
+    if (_pending != PendingCommand::None &&
+        millis() - _pendingTime >= _pendingTimeout)
+    {
+        PN_COM_TRACE(" <- (Timeout)");
+        _lastError = -1;
+        endCommand(false);
+        return false;
+    }
+    return true;
+}
+
+bool NanoCellular::finishCommand()
+{
+    while (_pending != PendingCommand::None)
+    {
+        if (!serviceCommand())
+        {
+            return false;
+        }
+        callWatchdog();
+        delay(1);
+    }
+    return true;
+}
+
+void NanoCellular::endCommand(bool ok)
+{
+    PendingCommand command = _pending;
+    _pending = PendingCommand::None;
+    switch (command)
+    {
+        case PendingCommand::Send:
+            if (!ok)
+            {
+                // CME network errors are counted by checkResult()
+                if (_lastError != 30 && _lastError != 31)
+                {
+                    _linkFailures++;
+                }
+                _queueAttempt = millis();
+                PN_ERROR("Failed to send queued data");
+                break;
+            }
+            _linkFailures = 0;
+            _stats.txSocketBytes += _sendChunk;
+            _stats.connectionTxBytes += _sendChunk;
+            _wireSent += _sendChunk;
+            // The batch leaves the queue once all of it is accepted
+            if (_wireSent >= _wireLength &&
+                _batchTaken >= _batchLength)
+            {
+                _queue.remove(_batchRecords);
+                _batchLength = 0;
+                _batchTaken = 0;
+            }
+            break;
+        case PendingCommand::Recovery:
+            endPhase(ok);
+            break;
+        case PendingCommand::CellCache:
+            // Asked again on the next poll() when it failed
+            _cellCacheStale = !(ok && _pendingResult);
+            break;
+        case PendingCommand::Fota:
+            if (!ok)
+            {
+                // Refused, stays paused and poll() tries again after
+                // FOTA_RETRY_INTERVAL
+                PN_DEBUG("FOTA resume not accepted");
+                _fotaTime = millis();
+                break;
+            }
+            setFotaStage(FotaStage::Downloading);
+            break;
+        default:
+            break;
+    }
+}
+
+void NanoCellular::commandLine(char* line)
+{
+    // Information lines of a command poll() left running
+    // +CEREG: <n>,<stat>[,...]
+    if (_pending == PendingCommand::Probe &&
+        strncmp(line, "+CEREG: ", 8) == 0)
+    {
+        char* stat = strchr(line, ',');
+        if (stat)
+        {
+            _registration = (NetworkRegistrationState)atoi(stat + 1);
+        }
+    }
+    // %XMONITOR: <reg_status>,<full_name>,<short_name>,<plmn>,...
+    else if (_pending == PendingCommand::CellCache &&
+        strncmp(line, "%XMONITOR: ", 11) == 0)
+    {
+        _pendingResult = parseMonitor(line);
+    }
+    // #XSOCKET: <handle>,<type>,<protocol>
+    else if (_pending == PendingCommand::Recovery &&
+        _recoveryPhase == RecoveryPhase::OpenSocket &&
+        strncmp(line, "#XSOCKET: ", 10) == 0)
+    {
+        _socket = atoi(line + 10);
+    }
+    // #XTCPCONN: 1
+    else if (_pending == PendingCommand::Recovery &&
+        _recoveryPhase == RecoveryPhase::ConnectSocket &&
+        strcmp(line, "#XTCPCONN: 1") == 0)
+    {
+        _pendingResult = true;
+    }
+}
+
+bool NanoCellular::sendTx()
+{
+    if (_txLength == 0)
+    {
+        return true;
+    }
+    size_t sent = write(_txBuffer, _txLength);
+    if (sent != _txLength)
+    {
+        // Keep what was not sent for the next attempt
+        memmove(_txBuffer, _txBuffer + sent, _txLength - sent);
+        _txLength -= sent;
+        return false;
+    }
+    _txLength = 0;
+    return true;
+}
+
+bool NanoCellular::flushBlock()
+{
+    if (_lz == nullptr ||
+        _lz->blockLength == 0)
+    {
+        return true;
+    }
+    // Frames have to go out in the order they were compressed
+    if (!drainSend())
+    {
+        return false;
+    }
+    uint16_t block = _lz->blockLength;
+    uint16_t length = _lz->compress(_lz->block, block, _lz->frame);
+    _lz->blockLength = 0;
+    if (writeSocket(_lz->frame, length) != length)
+    {
+        // The peer's window is out of step now. The host is kept, so
+        // the supervisor reopens the socket with fresh windows.
+        PN_ERROR("Compressed stream broken, closing socket");
+        closeSocket();
+        return false;
+    }
+    _stats.txPayloadBytes += block;
+    return true;
+}
+
+void NanoCellular::closeSocket()
+{
+    if (_socket == 0)
+    {
+        return;
+    }
+    flushBlock();
+    sprintf(_buffer, "AT#XSOCKET=0,%i", _socket);
+    sendAndCheckReply(_buffer, _OK, 5000);
+    _socket = 0;
+}
+
+void NanoCellular::resetConnection()
+{
+    // A send still waiting for its reply belongs to the old connection
+    if (_pending == PendingCommand::Send)
+    {
+        finishCommand();
+    }
+    if (_lz != nullptr)
+    {
+        _lz->reset();
+    }
+    _txLength = 0;
+    _readLength = 0;
+    _readOffset = 0;
+    // A queue batch partly sent on the old connection starts over,
+    // its compressed frames do not match the new stream
+    _batchTaken = 0;
+    _wireLength = 0;
+    _wireSent = 0;
+    _stats.connectionTxBytes = 0;
+    _stats.connectionRxBytes = 0;
+}
+
+bool NanoCellular::drainSend()
+{
+    // Sends the rest of the batch under way, so other data does not
+    // end up in the middle of it
+    while (_pending == PendingCommand::Send ||
+        _wireSent < _wireLength ||
+        _batchTaken < _batchLength)
+    {
+        if (_pending == PendingCommand::None &&
+            !startSend())
+        {
+            return false;
+        }
+        // Anything else still running is finished first
+        bool sending = _pending == PendingCommand::Send;
+        if (!finishCommand() &&
+            sending)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool NanoCellular::readUrc()
+{
+    // Collect unsolicited lines without blocking, returns true
+    // when a complete line was processed. With the reader task these
+    // are the lines it queued while the lock was held.
+    while (uartAvailable())
+    {
+        char c = uartRead();
+        if (c == '\r')
+        {
+            continue;
+        }
+        if (c == '\n')
+        {
+            if (_urcIndex == 0)
+            {
+                continue;
+            }
+            _urcBuffer[_urcIndex] = 0;
+            _urcIndex = 0;
+            if (isUrc(_urcBuffer))
+            {
+                PN_COM_TRACE(" <- (URC) %s", _urcBuffer);
+                processUrc(_urcBuffer);
+            }
+            return true;
+        }
+        if (_urcIndex < URC_BUFFER_SIZE - 1)
+        {
+            _urcBuffer[_urcIndex++] = c;
+        }
+    }
+    return false;
+}
+
+bool NanoCellular::isUrc(const char* line)
+{
+    // Only the unsolicited forms, replies to commands look different:
+    // +CEREG: <stat> has no comma unlike the reply to AT+CEREG?, and
+    // a #XGPS: fix carries coordinates unlike the start reply
+    if (strncmp(line, "+CEREG: ", 8) == 0)
+    {
+        return strchr(line, ',') == nullptr;
+    }
+    if (strncmp(line, "#XGPS: ", 7) == 0)
+    {
+        return strchr(line, '.') != nullptr;
+    }
+    if (strncmp(line, "#XSOCKET: ", 10) == 0)
+    {
+        return strstr(line, "closed") != nullptr;
+    }
+    return strncmp(line, "#XFOTA: ", 8) == 0 ||
+        strncmp(line, "%XMODEMSLEEP: ", 14) == 0;
+}
+
+void NanoCellular::processUrc(const char* line)
+{
+    // +CEREG: <stat>
+    if (strncmp(line, "+CEREG: ", 8) == 0)
+    {
+        _registration = (NetworkRegistrationState)atoi(line + 8);
+        PN_DEBUG("Registration changed: %i", (uint8_t)_registration);
+        // A download interrupted by the link going down is resumed later
+        if (_fotaStage == FotaStage::Downloading &&
+            !isRegistered())
+        {
+            setFotaStage(FotaStage::Paused);
+        }
+    }
+    // %XMODEMSLEEP: <type>,<time>
+    // type 1 is PSM, a time of 0 means the modem woke up
+    else if (strncmp(line, "%XMODEMSLEEP: ", 14) == 0)
+    {
+        char* ptr;
+        uint8_t type = strtol(line + 14, &ptr, 10);
+        uint32_t time = (*ptr == ',') ? strtoul(ptr + 1, nullptr, 10) : 0;
+        if (type == 1)
+        {
+            setRadioState(time > 0 ? RadioState::Psm : RadioState::On);
+        }
+    }
+    // #XSOCKET: <handle>,"closed"
+    else if (strncmp(line, "#XSOCKET: ", 10) == 0 &&
+        strstr(line, "closed"))
+    {
+        PN_DEBUG("Socket closed by network");
+        _socket = 0;
+    }
+    // #XGPS: <latitude>,<longitude>,<altitude>,<accuracy>,<speed>,<heading>,"<datetime>"
+    else if (strncmp(line, "#XGPS: ", 7) == 0)
+    {
+        parseFix(line + 7);
+    }
+    // #XFOTA: <stage>,<status>[,<info>]
+    // stage 1 is download with info as percentage, 4 is complete
+    // status 0 is ok, 1 is failed and 2 is cancelled
+    else if (strncmp(line, "#XFOTA: ", 8) == 0)
+    {
+        char* ptr;
+        uint8_t stage = strtol(line + 8, &ptr, 10);
+        uint8_t status = (*ptr == ',') ? strtol(ptr + 1, &ptr, 10) : 0;
+        uint8_t info = (*ptr == ',') ? strtol(ptr + 1, &ptr, 10) : 0;
+        if (status == 1)
+        {
+            // Link drops show up as download failures
+            setFotaStage(isRegistered() ? FotaStage::Failed : FotaStage::Paused);
+        }
+        else if (status == 2)
+        {
+            setFotaStage(FotaStage::Idle);
+        }
+        else if (stage == 1)
+        {
+            _fotaProgress = info;
+            setFotaStage(FotaStage::Downloading);
+        }
+        else if (stage == 4)
+        {
+            _fotaProgress = 100;
+            setFotaStage(FotaStage::Downloaded);
+        }
+    }
+}
+
+bool NanoCellular::enableGnss()
+{
+    if (_gnssEnabled)
+    {
+        return true;
+    }
+
+    // The system mode is kept in NVM, but it can only be changed
+    // in airplane mode. The socket does not survive that, the
+    // supervisor reopens it afterwards.
+    closeSocket();
+    _gnssEnabled = true;
+    if (!disconnectNetwork() ||
+        !sendSystemMode() ||
+        !attachNetwork())
+    {
+        _gnssEnabled = false;
+        PN_ERROR("Failed to enable GNSS");
+        return false;
+    }
+    return true;
+}
+
+void NanoCellular::parseFix(const char* line)
+{
+    // Status reports look like "#XGPS: 1,<status>", fixes have decimals
+    const char* comma = strchr(line, ',');
+    const char* dot = strchr(line, '.');
+    if (!comma || !dot || dot > comma)
+    {
+        return;
+    }
+
+    char* ptr;
+    GnssFix fix;
+    fix.latitude = strtod(line, &ptr);
+    fix.longitude = strtod(ptr + 1, &ptr);
+    fix.altitude = strtod(ptr + 1, &ptr);
+    fix.accuracy = strtod(ptr + 1, &ptr);
+    fix.speed = strtod(ptr + 1, &ptr);
+    fix.heading = strtod(ptr + 1, &ptr);
+    fix.datetime[0] = 0;
+    const char* quote = strchr(ptr, '"');
+    if (quote)
+    {
+        strncpy(fix.datetime, quote + 1, sizeof(fix.datetime) - 1);
+        fix.datetime[sizeof(fix.datetime) - 1] = 0;
+        char* end = strchr(fix.datetime, '"');
+        if (end)
+        {
+            *end = 0;
+        }
+    }
+
+    _lastFix = fix;
+    _fixValid = true;
+    if (gnsscallback != nullptr)
+    {
+        (gnsscallback)(&_lastFix);
+    }
+}
+
+void NanoCellular::setRadioState(RadioState state)
+{
+    updateRadioTime();
+    _radioState = state;
+}
+
+void NanoCellular::updateRadioTime()
+{
+    uint32_t now = millis();
+    uint32_t elapsed = now - _radioTime;
+    _radioTime = now;
+    switch (_radioState)
+    {
+        case RadioState::Off:
+            _stats.radioOffTime += elapsed;
+            break;
+        case RadioState::On:
+            _stats.radioOnTime += elapsed;
+            break;
+        case RadioState::Psm:
+            _stats.psmTime += elapsed;
+            break;
+    }
+}
+
+bool NanoCellular::sendFota()
+{
+    // Progress is reported through #XFOTA URCs, handled by poll()
+    formatFota();
+    return sendAndCheckReply(_buffer, _OK, 5000);
+}
+
+void NanoCellular::formatFota()
+{
+    sprintf(_buffer, "AT#XFOTA=1,\"%s\"", _fotaUrl);
+}
+
+void NanoCellular::setFotaStage(FotaStage stage)
+{
+    _fotaStage = stage;
+    _fotaTime = millis();
+    if (fotacallback != nullptr)
+    {
+        (fotacallback)(_fotaStage, _fotaProgress);
+    }
+}
+
+void NanoCellular::callWatchdog()
+{
+    if (watchdogcallback != nullptr)
+    {
+        (watchdogcallback)();
+    }
+}
+
+bool NanoCellular::setPower(bool state)
+{
+    PN_LOCK();
+    uint32_t timeout;
+	PN_DEBUG("setPower: %i", state);
+    if (state == true)
+    {
+        if (_powerPin != NOT_A_PIN)
+        {
+            digitalWrite(_powerPin, LOW);
+            delay(POWER_PULSE_TIME);
+            digitalWrite(_powerPin, HIGH);
+        }
+
+        PN_TRACE_START("Waiting for module");
+        while (!getStatus())
+        {
+            PN_TRACE_PART(".");
+            callWatchdog();
+            delay(500);
+        }
+        PN_TRACE_END("");
+
+        PN_DEBUG("Open communications");
+        int32_t timeout = 7000;
+        while (timeout > 0) 
+        {
+            flushInput();
+            if (sendAndCheckReply(_AT, "AT", 1000))
+            {
+                PN_COM_TRACE("GOT AT");
+                break;
+            }
+            callWatchdog();
+            delay(500);
+            timeout -= 500;
+        }
+
+        if (timeout <= 0)
+        {
+            PN_ERROR("Failed to initialize cellular module");
+            return false;
+        }
+        // The module starts with the radio on, radio time counts from here
+        setRadioState(RadioState::On);
+    }
+    else
+    {
+        if (!getStatus())
+        {
+            PN_COM_TRACE("Module already off");
+            return true;
+        }
+        PN_DEBUG("Powering down module");        
+        // First check if already awake
+        timeout = 5000;
+        while (timeout > 0) 
+        {
+            flushInput();
+            if (sendAndCheckReply(_AT, "OK", 1000))
+            {   
+                PN_COM_TRACE("GOT AT");
+                break;
+            }
+            if (sendAndCheckReply(_AT, "OK", 1000))
+            {   
+                PN_COM_TRACE("GOT OK");
+                break;
+            }            
+            callWatchdog();
+            delay(500);
+            timeout -= 500;
+        }
+        sendAndCheckReply("ATE0", _OK, 1000);
+		
+        //if (!sendAndCheckReply("AT+QCFG=\"urc/port\",1,\"uart1\"", _OK))
+		if (!sendAndCheckReply("AT#URC=\"LWM2M\",1", _OK))
+		{
+			PN_ERROR("Could not start LWM2M urc messages");
+			return false;
+		}
+		if (!sendAndCheckReply("AT#URC=\"SOCK\",1", _OK))
+		{
+			PN_ERROR("Could not start SOCK urc messages");
+			return false;
+		}
+
+        if (!sendAndCheckReply("AT#SHUTDOWN", _OK, 10000))
+        {
+            return false;
+        }
+        // GNSS assistance data does not survive a shutdown
+        _assistanceValid = false;
+        timeout = millis() + 60000;  // max 60 seconds for a shutdown
+        while (timeout > millis())
+        {
+            if (readReply(1000, 1))
+            {
+                if (strstr(_buffer, "+SHUTDOWN"))
+                {
+                    if (_powerPin != NOT_A_PIN)
+                    {
+                        digitalWrite(_powerPin, LOW);
+                    }
+                    PN_DEBUG("Module powered down");
+                    setRadioState(RadioState::Off);
+
+                    break;
+                }
+            }
+            callWatchdog();
+        }
+        return false;
+    }
+    return true;
+}
+
+bool NanoCellular::getSimPresent()
+{
+    PN_LOCK();
+    // state is 0 if UICC not initialized or 1 if UICC initiailized
+    // Reply is:
+    // %XSIM: <state>
+    // OK
+    if (sendAndWaitForReply("AT%XSIM?"))
+    {
+        const char delimiter[] = " ";
+        char* token = strtok(_buffer, delimiter);
+        token = strtok(nullptr, delimiter);
+        if (token)
+        {
+            return token[0] == 0x31;
+        }        
     }
     return false;
 }
 
 NetworkRegistrationState NanoCellular::getNetworkRegistration()
 {
+    PN_LOCK();
     if (sendAndWaitForReply("AT+CEREG?", 1000, 3))   
     {
         const char delimiter[] = ",";
@@ -621,7 +2766,8 @@ NetworkRegistrationState NanoCellular::getNetworkRegistration()
             token = strtok(nullptr, delimiter);
             if (token)
             {
-                return (NetworkRegistrationState)(token[0] - 0x30);
+                _registration = (NetworkRegistrationState)(token[0] - 0x30);
+                return _registration;
             }
         }
     }
@@ -635,9 +2781,8 @@ bool NanoCellular::sendAndWaitForMultilineReply(const char* command, uint8_t lin
 
 bool NanoCellular::sendAndWaitForReply(const char* command, uint16_t timeout, uint8_t lines)
 {
-    flush();
-	PN_COM_TRACE(" -> %s", command);
-    _uart->println(command);
+    flushInput();
+    sendCommand(command);
     return readReply(timeout, lines);
 }
 
@@ -645,18 +2790,18 @@ bool NanoCellular::sendAndWaitFor(const char* command, const char* reply, uint16
 {
     uint16_t index = 0;
 
-    flush();
-	PN_COM_TRACE(" -> %s", command);
-    _uart->println(command);
-    while (timeout--)
+    flushInput();
+    sendCommand(command);
+    uint32_t start = millis();
+    while (true)
     {
         if (index > 254)
         {
             break;
         }
-        while (_uart->available())
+        while (uartAvailable())
         {
-            char c = _uart->read();
+            char c = uartRead();
             if (c == '\r')
             {
                 continue;
@@ -674,7 +2819,7 @@ bool NanoCellular::sendAndWaitFor(const char* command, const char* reply, uint16
             PN_COM_TRACE("Match found");
             break;
         }
-        if (timeout <= 0)
+        if (millis() - start >= timeout)
         {
             PN_COM_TRACE_START(" <- (Timeout) ");
             PN_COM_TRACE_ASCII(_buffer, index);
@@ -694,23 +2839,30 @@ bool NanoCellular::sendAndWaitFor(const char* command, const char* reply, uint16
 bool NanoCellular::sendAndCheckReply(const char* command, const char* reply, uint16_t timeout)
 {
     sendAndWaitForReply(command, timeout);
+    checkResult(_buffer);
     return (strstr(_buffer, reply) != nullptr);
 }
 
 bool NanoCellular::readReply(uint16_t timeout, uint8_t lines)
 {
     uint16_t index = 0;
+    uint16_t lineStart = 0;
     uint16_t linesFound = 0;
+    // With lines 0 the reply ends with its final result
+    uint8_t wanted = lines > 0 ? lines : 1;
 
-    while (timeout--)
+    uint32_t start = millis();
+    while (true)
     {
-        if (index > 254)
+        // Leave room for the terminator
+        if (index >= sizeof(_buffer) - 1)
         {
             break;
         }
-        while (_uart->available())
+        while (index < sizeof(_buffer) - 1 &&
+            uartAvailable())
         {
-            char c = _uart->read();
+            char c = uartRead();
             if (c == '\r')
             {
                 continue;
@@ -723,21 +2875,43 @@ bool NanoCellular::readReply(uint16_t timeout, uint8_t lines)
             _buffer[index++] = c;
             if (c == '\n')
             {
-				linesFound++;
+                // URCs can turn up between the lines of a reply
+                _buffer[index - 1] = 0;
+                if (isUrc(_buffer + lineStart))
+                {
+                    PN_COM_TRACE(" <- (URC) %s", _buffer + lineStart);
+                    processUrc(_buffer + lineStart);
+                    index = lineStart;
+                    continue;
+                }
+                if (lines == 0 &&
+                    (strcmp(_buffer + lineStart, _OK) == 0 ||
+                    strstr(_buffer + lineStart, "ERROR") != nullptr))
+                {
+                    linesFound = 1;
+                }
+                _buffer[index - 1] = '\n';
+                lineStart = index;
+                if (lines > 0)
+                {
+                    linesFound++;
+                }
             }
-    		if (linesFound >= lines)
+    		if (linesFound >= wanted)
 	    	{
     			break;
 	    	}            
         }
 
-   		if (linesFound >=lines)
+   		if (linesFound >= wanted)
     	{
    			break;
     	}            
 
-        if (timeout <= 0)
+        if (millis() - start >= timeout)
         {
+            // Keep what did arrive for checkResult()
+            _buffer[index] = 0;
             PN_COM_TRACE_START(" <- (Timeout) ");
             PN_COM_TRACE_ASCII(_buffer, index);
             PN_COM_TRACE_END("");
@@ -753,29 +2927,303 @@ bool NanoCellular::readReply(uint16_t timeout, uint8_t lines)
     return true;
 }
 
-bool NanoCellular::checkResult()
+uint16_t NanoCellular::readRawReply(uint16_t timeout)
+{
+    // Bytes are kept as they come. The reply ends with OK after the
+    // #XTCPRECV line, or with an error before any data.
+    uint16_t index = 0;
+    uint16_t lineStart = 0;
+    bool data = false;
+    bool info = false;
+    uint32_t start = millis();
+    _buffer[0] = 0;
+    while (index < sizeof(_buffer) - 1)
+    {
+        if (!uartAvailable())
+        {
+            if (millis() - start >= timeout)
+            {
+                PN_COM_TRACE_START(" <- (Timeout) ");
+                PN_COM_TRACE_ASCII(_buffer, index);
+                PN_COM_TRACE_END("");
+                return index;
+            }
+            callWatchdog();
+            delay(1);
+            continue;
+        }
+        char c = uartRead();
+        _buffer[index++] = c;
+        _buffer[index] = 0;
+        if (c != '\n')
+        {
+            continue;
+        }
+        char* line = _buffer + lineStart;
+        lineStart = index;
+        if (info)
+        {
+            if (strcmp(line, "OK\r\n") == 0)
+            {
+                break;
+            }
+        }
+        else if (strncmp(line, "#XTCPRECV: ", 11) == 0)
+        {
+            info = true;
+        }
+        else if (!data &&
+            (strcmp(line, "ERROR\r\n") == 0 ||
+            strncmp(line, _CME_ERROR, strlen(_CME_ERROR)) == 0))
+        {
+            break;
+        }
+        else if (strcmp(line, "\r\n") != 0 &&
+            !isUrc(line))
+        {
+            data = true;
+        }
+    }
+    PN_COM_TRACE_START(" <- ");
+    PN_COM_TRACE_ASCII(_buffer, index);
+    PN_COM_TRACE_END("");
+    return index;
+}
+
+void NanoCellular::sendCommand(const char* command)
+{
+    PN_COM_TRACE(" -> %s", command);
+    _stats.txUartBytes += strlen(command) + 2;
+    captureData(CAPTURE_DIRECTION_TX, (const uint8_t*)command, strlen(command));
+    captureData(CAPTURE_DIRECTION_TX, (const uint8_t*)"\r\n", 2);
+    _uart->println(command);
+}
+
+void NanoCellular::captureData(uint8_t direction, const uint8_t* data, size_t length)
+{
+    if (_capture == nullptr)
+    {
+        return;
+    }
+#ifdef PICSIL_NANO_RTOS
+    // The reader task records received bytes while callers record
+    // what they send, with a lock of its own as the reader must not
+    // wait for the driver lock
+    if (_captureMutex != nullptr)
+    {
+        xSemaphoreTake(_captureMutex, portMAX_DELAY);
+        if (_capture != nullptr)
+        {
+            _capture->record(direction, data, length);
+        }
+        xSemaphoreGive(_captureMutex);
+        return;
+    }
+#endif
+    _capture->record(direction, data, length);
+}
+
+int NanoCellular::uartAvailable()
+{
+#ifdef PICSIL_NANO_RTOS
+    if (_rxQueue != nullptr)
+    {
+        return uxQueueMessagesWaiting(_rxQueue);
+    }
+#endif
+    return _uart->available();
+}
+
+int NanoCellular::uartRead()
+{
+#ifdef PICSIL_NANO_RTOS
+    if (_rxQueue != nullptr)
+    {
+        uint8_t c;
+        if (xQueueReceive(_rxQueue, &c, 0) != pdTRUE)
+        {
+            return -1;
+        }
+        return c;
+    }
+#endif
+    int c = _uart->read();
+    if (c >= 0)
+    {
+        _stats.rxUartBytes++;
+        uint8_t b = c;
+        captureData(CAPTURE_DIRECTION_RX, &b, 1);
+    }
+    return c;
+}
+
+#ifdef PICSIL_NANO_RTOS
+void NanoCellular::startReader()
+{
+    if (_readerTask != nullptr)
+    {
+        return;
+    }
+    _mutex = xSemaphoreCreateRecursiveMutex();
+    _captureMutex = xSemaphoreCreateMutex();
+    _rxQueue = xQueueCreate(PICSIL_NANO_RTOS_QUEUE, sizeof(uint8_t));
+    xTaskCreate(readerTask, "NanoReader", PICSIL_NANO_RTOS_STACK, this,
+        PICSIL_NANO_RTOS_PRIORITY, &_readerTask);
+}
+
+void NanoCellular::readerTask(void* parameter)
+{
+    NanoCellular* cell = (NanoCellular*)parameter;
+    for (;;)
+    {
+        cell->readerLoop();
+        vTaskDelay(1);
+    }
+}
+
+void NanoCellular::readerLoop()
+{
+    // Take back what the last lock holder left in the queue, so a URC
+    // that arrived after its last reply is neither lost nor split
+    if (!_commandActive &&
+        uxQueueMessagesWaiting(_rxQueue) > 0 &&
+        xSemaphoreTakeRecursive(_mutex, 0) == pdTRUE)
+    {
+        uint8_t c;
+        while (xQueueReceive(_rxQueue, &c, 0) == pdTRUE)
+        {
+            readerByte(c);
+        }
+        xSemaphoreGiveRecursive(_mutex);
+    }
+
+    // While a caller holds the lock everything received, including raw
+    // data, goes to the receive queue. Otherwise lines are collected
+    // here and dispatched as URCs.
+    while (_uart->available())
+    {
+        uint8_t c = _uart->read();
+        // The reader does not hold the lock, see getStats()
+        _readerRxBytes++;
+        captureData(CAPTURE_DIRECTION_RX, &c, 1);
+        if (_commandActive)
+        {
+            // A line started before the lock was taken goes along
+            queueLine(_readerLine, _readerIndex);
+            _readerIndex = 0;
+            queueLine((const char*)&c, 1);
+            continue;
+        }
+        readerByte(c);
+    }
+}
+
+void NanoCellular::readerByte(uint8_t c)
+{
+    if (c == '\r')
+    {
+        return;
+    }
+    if (c != '\n')
+    {
+        if (_readerIndex < URC_BUFFER_SIZE - 1)
+        {
+            _readerLine[_readerIndex++] = c;
+        }
+        return;
+    }
+    if (_readerIndex == 0)
+    {
+        return;
+    }
+    _readerLine[_readerIndex] = 0;
+    uint8_t length = _readerIndex;
+    _readerIndex = 0;
+
+    // URCs change driver state, so they are only dispatched under the
+    // lock. The reader must not wait for it, a caller holding it needs
+    // the reader for its replies. If it is taken the line is queued and
+    // the caller dispatches it with its replies.
+    if (xSemaphoreTakeRecursive(_mutex, 0) != pdTRUE)
+    {
+        queueLine(_readerLine, length);
+        queueLine("\n", 1);
+        return;
+    }
+    if (isUrc(_readerLine))
+    {
+        PN_COM_TRACE(" <- (URC) %s", _readerLine);
+        processUrc(_readerLine);
+    }
+    xSemaphoreGiveRecursive(_mutex);
+}
+
+void NanoCellular::queueLine(const char* data, uint8_t length)
+{
+    for (uint8_t i = 0; i < length; i++)
+    {
+        if (xQueueSend(_rxQueue, data + i, pdMS_TO_TICKS(100)) != pdTRUE)
+        {
+            PN_COM_ERROR("Receive queue overflow");
+        }
+    }
+}
+
+NanoLock::NanoLock(NanoCellular* cell)
+{
+    _cell = cell;
+    if (_cell->_mutex == nullptr)
+    {
+        return;
+    }
+    xSemaphoreTakeRecursive(_cell->_mutex, portMAX_DELAY);
+    // Everything received from now on is for the lock holder
+    _cell->_lockDepth++;
+    _cell->_commandActive = true;
+}
+
+NanoLock::~NanoLock()
+{
+    if (_cell->_mutex == nullptr)
+    {
+        return;
+    }
+    // The reply to a command poll() left running still has to reach it
+    if (--_cell->_lockDepth == 0)
+    {
+        _cell->_commandActive = _cell->_pending != PendingCommand::None;
+    }
+    xSemaphoreGiveRecursive(_cell->_mutex);
+}
+#endif
+
+bool NanoCellular::checkResult(const char* reply)
 {   
     // CheckResult returns one of these:
     // true    OK
     // false   Unknown result
     // false  CME Error
     //
-    char* token = strstr(_buffer, _OK);
+    const char* token = strstr(reply, _OK);
     if (token)
     {
-        //PN_TRACE("*OK - %s", _buffer);
+        //PN_TRACE("*OK - %s", reply);
         _lastError = 0;
         return true;
     }
-    token = strstr(_buffer, _CME_ERROR);
+    token = strstr(reply, _CME_ERROR);
     if (!token)
     {
-        //PN_TRACE("*NO CME ERROR: %s", _buffer);
+        //PN_TRACE("*NO CME ERROR: %s", reply);
         _lastError = -1;
         return false;
     }
-    //PN_TRACE("*CME ERROR: %s", _buffer);
-    token = strtok(_buffer, _CME_ERROR);
-    _lastError = atoi(token);
+    //PN_TRACE("*CME ERROR: %s", reply);
+    _lastError = atoi(token + strlen(_CME_ERROR));
+    // 30 no network service, 31 network timeout
+    if (_lastError == 30 || _lastError == 31)
+    {
+        _linkFailures++;
+    }
     return false;
 }
\ No newline at end of file
@@ -5,6 +5,15 @@
 #include <Ethernet.h>
 #include <HardwareSerial.h>
 #include <M2M_Logger.h>
+#include "picsil-NanoQueue.h"
+#include "picsil-NanoLz.h"
+#include "picsil-NanoCapture.h"
+#ifdef PICSIL_NANO_RTOS
+#include <FreeRTOS.h>
+#include <semphr.h>
+#include <queue.h>
+#include <task.h>
+#endif
 
 #define NOT_A_PIN   -1
 #define FLASHSTR	__FlashStringHelper*
@@ -50,6 +59,61 @@
 #define PN_COM_TRACE_ASCII(buffer, size)
 #endif
 
+// Define PICSIL_NANO_RTOS to share one module between FreeRTOS tasks.
+// A reader task then owns the UART and routes replies to the task holding
+// the module lock and URCs to the driver. Public calls take the lock, so
+// callers only block their own task, apart from getStatus() and
+// isDataPending() which only read a pin or flag.
+// The flag changes the class layout, so it has to be set for the whole
+// build (build_flags or compiler options), not defined in one source file.
+#ifdef PICSIL_NANO_RTOS
+// Reader task stack, in bytes on ESP32 and in words on other ports
+#ifndef PICSIL_NANO_RTOS_STACK
+#define PICSIL_NANO_RTOS_STACK      4096
+#endif
+#ifndef PICSIL_NANO_RTOS_PRIORITY
+#define PICSIL_NANO_RTOS_PRIORITY   2
+#endif
+#ifndef PICSIL_NANO_RTOS_QUEUE
+#define PICSIL_NANO_RTOS_QUEUE      512
+#endif
+#define PN_LOCK() NanoLock __lock(this)
+#else
+#define PN_LOCK()
+#endif
+
+struct NanoStats
+{
+    // Bytes passed to write() and returned by read()
+    uint32_t txPayloadBytes;
+    uint32_t rxPayloadBytes;
+    // Bytes on the socket after compression, in total and for the
+    // current connection
+    uint32_t txSocketBytes;
+    uint32_t rxSocketBytes;
+    uint32_t connectionTxBytes;
+    uint32_t connectionRxBytes;
+    // Every byte over the UART, commands and framing included
+    uint32_t txUartBytes;
+    uint32_t rxUartBytes;
+    // Milliseconds with the radio on (CFUN=1), in PSM and off
+    uint32_t radioOnTime;
+    uint32_t psmTime;
+    uint32_t radioOffTime;
+    // Module counters from AT%XCONNSTAT, see updateModemStats()
+    uint32_t modemTxKBytes;
+    uint32_t modemRxKBytes;
+    uint16_t modemPacketMax;
+    uint16_t modemPacketAverage;
+};
+
+enum class RadioState : uint8_t
+{
+    Off = 0,
+    On,
+    Psm
+};
+
 enum class NetworkRegistrationState : uint8_t
 {
     NotRegistered = 0,
@@ -70,21 +134,150 @@ enum class TlsEncryption : uint8_t
     All
 };
 
+enum class SystemMode : uint8_t
+{
+    LteM = 0,
+    NbIot,
+    LteMNbIot
+};
+
+// Last cell the module registered on, store it between boots to
+// bias the next attach towards it
+struct CellCache
+{
+    bool valid;
+    char plmn[7];
+    uint8_t band;
+    uint32_t cellId;
+};
+
+enum class RecoveryStep : uint8_t
+{
+    None = 0,
+    ReopenSocket,
+    CycleRadio,
+    PowerCycle
+};
+
+// Commands poll() leaves running while it returns, see startCommand()
+enum class PendingCommand : uint8_t
+{
+    None = 0,
+    Send,
+    Recovery,
+    Probe,
+    CellCache,
+    Fota
+};
+
+// Where a recovery step has got to. Each phase sends one command or
+// waits on a pin or timer, so poll() never blocks on a recovery.
+enum class RecoveryPhase : uint8_t
+{
+    Idle = 0,
+    Shutdown,
+    PowerOn,
+    Wake,
+    Configure,
+    RadioOff,
+    SystemMode,
+    BandLock,
+    Operator,
+    RadioOn,
+    Register,
+    CloseSocket,
+    OpenSocket,
+    ConnectSocket
+};
+
+enum class GnssMode : uint8_t
+{
+    Single = 0,
+    Periodic,
+    Continuous
+};
+
+struct GnssFix
+{
+    double latitude;
+    double longitude;
+    float altitude;
+    float accuracy;
+    float speed;
+    float heading;
+    char datetime[20];
+};
+
+enum class FotaStage : uint8_t
+{
+    Idle = 0,
+    Downloading,
+    Paused,
+    Downloaded,
+    Verified,
+    Failed
+};
+
 #define FILE_HANDLE         uint32_t
 #define NOT_A_FILE_HANDLE   -1
 #define SOCKET_TIMEOUT      1
+#define SOCKET_MAX_SEND     100
+#define SOCKET_MAX_RECV     100
+#define SOCKET_TX_BUFFER    SOCKET_MAX_SEND
+#define SOCKET_SEND_TIMEOUT 5000
+#define QUEUE_RETRY_INTERVAL 10000
+#define URC_BUFFER_SIZE     160
+#define FOTA_URL_SIZE       128
+#define FOTA_STALL_TIMEOUT  120000
+#define FOTA_RETRY_INTERVAL 10000
+#define BAND_MASK_SIZE      11
+#define CELL_CACHE_TIMEOUT  20000
+#define INDICATE_MAX_INSTANCES 4
+#define HOST_NAME_SIZE      64
+#define LINK_PROBE_INTERVAL 60000
+#define LINK_FAILURE_LIMIT  3
+#define LINK_BACKOFF_MIN    2000
+#define LINK_BACKOFF_MAX    300000
+#define LINK_ATTACH_TIMEOUT 60000
+#define POWER_PULSE_TIME    300
+#define POWER_OFF_TIMEOUT   70000
+#define GNSS_FIX_TIMEOUT    120
+#define GNSS_ASSISTANCE_VALIDITY 7200000
 
 #define WATCHDOG_CALLBACK_SIGNATURE void (*watchdogcallback)()
+#define GNSS_CALLBACK_SIGNATURE void (*gnsscallback)(const GnssFix* fix)
+#define FOTA_CALLBACK_SIGNATURE void (*fotacallback)(FotaStage stage, uint8_t progress)
+#define QUEUE_COMPACT_CALLBACK_SIGNATURE uint16_t (*compactcallback)(uint8_t* batch, uint16_t length, uint16_t records)
+
+#ifdef PICSIL_NANO_RTOS
+class NanoCellular;
+
+class NanoLock
+{
+public:
+    NanoLock(NanoCellular* cell);
+    ~NanoLock();
+
+private:
+    NanoCellular* _cell;
+};
+#endif
 
 class NanoCellular : public Client
 {
+#ifdef PICSIL_NANO_RTOS
+    friend class NanoLock;
+#endif
+
 public:
-    NanoCellular(int8_t powerPin = NOT_A_PIN, int8_t statusPin = NOT_A_PIN);
+    NanoCellular(int8_t powerPin = NOT_A_PIN, int8_t statusPin = NOT_A_PIN, int8_t indicatePin = NOT_A_PIN);
 
     bool begin(HardwareSerial* uart);
+    bool begin(Stream* stream);
 
 	// Logging
 	void setLogger(Logger* logger);
+    void setCapture(NanoCapture* capture);
 
 	bool setPower(bool state);
     bool getStatus();    
@@ -108,29 +301,58 @@ public:
     bool connectNetwork();
     bool disconnectNetwork();
 
+    // Attach configuration, applied by begin() and connectNetwork()
+    bool setSystemMode(SystemMode mode);
+    bool setBandLock(const uint8_t* bands, uint8_t count);
+    bool setOperator(const char* plmn);
+    void setCellCache(const CellCache* cache);
+    void getCellCache(CellCache* cache);
+    bool updateCellCache();
+
     // HTTP client interface
 //   bool httpGet(const char* url, const char* fileName);
 
     // TCP Client interface
-//    int connect(IPAddress ip, uint16_t port);
-//    int connect(const char *host, uint16_t port);
+    int connect(IPAddress ip, uint16_t port);
+    int connect(const char *host, uint16_t port);
 //    int connect(IPAddress ip, uint16_t port, TlsEncryption encryption);
 //    int connect(const char *host, uint16_t port, TlsEncryption encryption);
     size_t write(uint8_t);
     size_t write(const uint8_t *buf, size_t size);
     int available();
+    // Set from the indicate pin interrupt, safe to check before sleeping
+    bool isDataPending();
     int read();
     int read(uint8_t *buf, size_t size);
     int peek();
+    // Sends data held back for compression
     void flush();
-//    void stop();
-//    uint8_t connected();
-//    operator bool()
-//    {
-//        return connected();
-//    }
+    void stop();
+    uint8_t connected();
+    operator bool()
+    {
+        return connected();
+    }
+
+    // Transmit buffer for encoders writing in place, sent when full
+    uint8_t* getTxBuffer(size_t* free);
+    // Fails without committing if length is more than the free space
+    bool commitTx(size_t length);
+    bool flushTx();
+
+    // Per connection compression, nullptr turns it off
+    void setCompression(NanoLz* lz);
+
+    // Statistics
+    void getStats(NanoStats* stats);
+    void resetStats();
+    bool updateModemStats();
+    float getCompressionRatio();
 
     // File client interface
+    // Not available: the Serial LTE Modem firmware on the nRF9160 has no
+    // AT commands for a user file system, so there is nothing to build
+    // these on. Kept for reference until the firmware provides one.
 //    FILE_HANDLE openFile(const char* fileName, bool overWrite = false);
 //    bool readFile(FILE_HANDLE fileHandle, uint8_t* buffer, uint32_t length);
 //    bool writeFile(FILE_HANDLE fileHandle, const uint8_t* buffer, uint32_t length);
@@ -144,8 +366,48 @@ public:
 //    uint32_t getFileSize(const char* fileName);
 //    bool deleteFile(const char* fileName);
 
+    // Link supervision, runs from poll()
+    void setSupervisor(bool enabled);
+    bool checkLinkHealth();
+    bool isLinkUp();
+    RecoveryStep getRecoveryStep();
+
+    // GNSS
+    // Enabling GNSS the first time cycles the radio and closes the socket
+    bool startGnss(GnssMode mode, uint16_t interval = 0, bool assistance = true, bool requestPsm = false);
+    bool stopGnss();
+    bool getLastFix(GnssFix* fix);
+
+    // Modem firmware update
+    bool startFota(const char* url);
+    bool resumeFota();
+    bool cancelFota();
+    bool applyFota();
+    FotaStage getFotaStage();
+    uint8_t getFotaProgress();
+    bool refreshFirmwareVersion();
+
+    // Store and forward queue
+    // Queued records are sent by poll() without waiting for replies
+    bool queueRecord(const uint8_t* data, uint8_t length);
+    uint16_t getQueuedRecords();
+    uint16_t getDroppedRecords();
+    void setQueueStorage(NanoQueueStorage* storage);
+    bool flushQueue();
+
+    // Background processing, call from loop(). Commands it sends are
+    // left running and their replies picked up on later calls.
+    void poll();
+
     // Callbacks
     void setWatchdogCallback(WATCHDOG_CALLBACK_SIGNATURE);
+    // The batch holds <records> records, each preceded by its length byte.
+    // Returns the new length of the batch after compacting it in place.
+    void setQueueCompactCallback(QUEUE_COMPACT_CALLBACK_SIGNATURE);
+    // With PICSIL_NANO_RTOS these run on the reader task holding the
+    // module lock, so they must not call the driver
+    void setFotaCallback(FOTA_CALLBACK_SIGNATURE);
+    void setGnssCallback(GNSS_CALLBACK_SIGNATURE);
 
 private:
 //    bool activateSsl();
@@ -155,22 +417,159 @@ private:
     bool sendAndWaitFor(const char* command, const char* reply, uint16_t timeout);   
 	bool sendAndCheckReply(const char* command, const char* reply, uint16_t timeout = 1000);
     bool readReply(uint16_t timeout = 1000, uint8_t lines = 1);
-    bool checkResult();
+    uint16_t readRawReply(uint16_t timeout);
+    bool checkResult(const char* reply);
     void callWatchdog();
+    bool readUrc();
+    bool isUrc(const char* line);
+    void sendCommand(const char* command);
+    void setRadioState(RadioState state);
+    void updateRadioTime();
+    size_t writeSocket(const uint8_t *buf, size_t size);
+    void formatSend(const uint8_t* data, size_t length);
+    bool loadWire();
+    bool startSend();
+    bool startCommand(PendingCommand command, const char* text, uint32_t timeout, const char* reply = nullptr);
+    bool serviceCommand();
+    bool finishCommand();
+    void endCommand(bool ok);
+    void commandLine(char* line);
+    bool drainSend();
+    bool sendTx();
+    bool flushBlock();
+    void closeSocket();
+    void resetConnection();
+    void flushInput();
+    int readSocket(uint8_t *buf, size_t size);
+    int receiveSocket(uint8_t *buf, size_t size);
+    void attachIndicate();
+    static void indicateIsr0();
+    static void indicateIsr1();
+    static void indicateIsr2();
+    static void indicateIsr3();
+    int uartAvailable();
+    int uartRead();
+    void captureData(uint8_t direction, const uint8_t* data, size_t length);
+#ifdef PICSIL_NANO_RTOS
+    void startReader();
+    static void readerTask(void* parameter);
+    void readerLoop();
+    void readerByte(uint8_t c);
+    void queueLine(const char* data, uint8_t length);
+#endif
+    void processUrc(const char* line);
+    bool parseMonitor(char* line);
+    bool isRegistered();
+    bool attachNetwork();
+    bool sendSystemMode();
+    bool sendBandLock(const uint8_t* mask);
+    bool sendOperator(const char* plmn, uint8_t mode);
+    void formatSystemMode();
+    void formatBandLock(const uint8_t* mask);
+    void formatOperator(const char* plmn, uint8_t mode);
+    bool waitForRegistration(uint32_t timeout);
+    void configureModule();
+    void superviseLink();
+    void startRecovery(RecoveryStep step);
+    void serviceRecovery();
+    void endPhase(bool ok);
+    void setPhase(RecoveryPhase phase);
+    void endRecovery(bool ok);
+    void formatFota();
+    bool sendFota();
+    void setFotaStage(FotaStage stage);
+    bool enableGnss();
+    void parseFix(const char* line);
 
     int8_t _powerPin;
     int8_t _statusPin;
+    int8_t _indicatePin;
+    volatile bool _dataPending = false;
+    static NanoCellular* _indicateInstances[INDICATE_MAX_INSTANCES];
     int8_t _lastError = 0;
     uint32_t sslLength;
-    HardwareSerial* _uart;
-    Logger* _logger;
+    Stream* _uart = nullptr;
+    Logger* _logger = nullptr;
     uint16_t _socket = 0;
     char _buffer[255];
-    char _readBuffer[255];
+    char _readBuffer[SOCKET_MAX_RECV];
+    uint16_t _readLength = 0;
+    uint16_t _readOffset = 0;
     char _command[32];
 	char _firmwareVersion[20];
-    WATCHDOG_CALLBACK_SIGNATURE;
+    WATCHDOG_CALLBACK_SIGNATURE = nullptr;
+    QUEUE_COMPACT_CALLBACK_SIGNATURE = nullptr;
+    FOTA_CALLBACK_SIGNATURE = nullptr;
+    GNSS_CALLBACK_SIGNATURE = nullptr;
     TlsEncryption _encryption;
+    NetworkRegistrationState _registration = NetworkRegistrationState::Unknown;
+    char _urcBuffer[URC_BUFFER_SIZE];
+    uint8_t _urcIndex = 0;
+    NanoQueue _queue;
+    uint8_t _queueBatch[QUEUE_BATCH_SIZE];
+    uint16_t _batchLength = 0;
+    uint16_t _batchRecords = 0;
+    uint16_t _batchTaken = 0;
+    uint32_t _queueAttempt = 0;
+    const uint8_t* _wire = nullptr;
+    uint16_t _wireLength = 0;
+    uint16_t _wireSent = 0;
+    uint16_t _sendChunk = 0;
+    PendingCommand _pending = PendingCommand::None;
+    uint32_t _pendingTime = 0;
+    uint32_t _pendingTimeout = 0;
+    const char* _pendingReply = nullptr;
+    bool _pendingResult = false;
+    SystemMode _systemMode = SystemMode::LteMNbIot;
+    bool _systemModePending = false;
+    bool _gnssEnabled = false;
+    bool _gnssPsm = false;
+    uint8_t _bandMask[BAND_MASK_SIZE] = {};
+    char _plmn[7] = "";
+    CellCache _cellCache = {};
+    bool _cellCacheStale = false;
+#ifdef PICSIL_NANO_RTOS
+    SemaphoreHandle_t _mutex = nullptr;
+    SemaphoreHandle_t _captureMutex = nullptr;
+    QueueHandle_t _rxQueue = nullptr;
+    TaskHandle_t _readerTask = nullptr;
+    volatile bool _commandActive = false;
+    uint8_t _lockDepth = 0;
+    char _readerLine[URC_BUFFER_SIZE];
+    uint8_t _readerIndex = 0;
+    // Only written by the reader task, added in by getStats()
+    volatile uint32_t _readerRxBytes = 0;
+    uint32_t _readerRxBase = 0;
+#endif
+    uint8_t _txBuffer[SOCKET_TX_BUFFER];
+    size_t _txLength = 0;
+    NanoLz* _lz = nullptr;
+    NanoCapture* _capture = nullptr;
+    NanoStats _stats = {};
+    RadioState _radioState = RadioState::Off;
+    uint32_t _radioTime = 0;
+    char _host[HOST_NAME_SIZE] = "";
+    uint16_t _port = 0;
+    bool _supervise = false;
+    uint8_t _linkFailures = 0;
+    uint32_t _probeTime = 0;
+    RecoveryStep _recoveryStep = RecoveryStep::None;
+    uint32_t _recoveryTime = 0;
+    uint32_t _recoveryBackoff = LINK_BACKOFF_MIN;
+    uint32_t _recoveryWait = 0;
+    RecoveryPhase _recoveryPhase = RecoveryPhase::Idle;
+    uint32_t _phaseTime = 0;
+    bool _phaseActive = false;
+    bool _recoveryFailed = false;
+    uint8_t _configIndex = 0;
+    GnssFix _lastFix = {};
+    bool _fixValid = false;
+    bool _assistanceValid = false;
+    uint32_t _assistanceTime = 0;
+    FotaStage _fotaStage = FotaStage::Idle;
+    uint8_t _fotaProgress = 0;
+    char _fotaUrl[FOTA_URL_SIZE];
+    uint32_t _fotaTime = 0;
 
     boolean httpsredirect;
     const char* _useragent = "PP";
@@ -178,7 +577,7 @@ private:
     const char* _OK = "OK";
     const char* _ERROR = "ERROR";
     const char* _CONNECT = "CONNECT";
-    const char* _CME_ERROR = "CME ERROR: ";
+    const char* _CME_ERROR = "+CME ERROR: ";
     const char* _INET_PREFIX = "I";
     const char* _SSL_PREFIX = "SSL";
 };
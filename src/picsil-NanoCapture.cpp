@@ -0,0 +1,240 @@
+//---------------------------------------------------------------------------------------------
+//
+// UART capture and replay for Nimbelink Skywire Nano cellular modules.
+//
+// Copyright 2020 picsil LLC
+//
+// Licensed under the MIT license, see the LICENSE.txt file.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include <Arduino.h>
+#include "picsil-NanoCapture.h"
+
+NanoCapture::NanoCapture(Print* sink)
+{
+    _sink = sink;
+}
+
+void NanoCapture::begin()
+{
+    const uint8_t header[] = { 'P', 'N', 'C', CAPTURE_VERSION };
+    _sink->write(header, sizeof(header));
+    _length = 0;
+    _previous = micros();
+}
+
+void NanoCapture::record(uint8_t direction, const uint8_t* data, size_t length)
+{
+    uint32_t now = micros();
+    if (_length > 0 &&
+        (direction != _direction || now - _last > CAPTURE_GAP))
+    {
+        flush();
+    }
+    for (size_t i = 0; i < length; i++)
+    {
+        if (_length == CAPTURE_RECORD_SIZE)
+        {
+            flush();
+        }
+        if (_length == 0)
+        {
+            _direction = direction;
+            _time = now;
+        }
+        _data[_length++] = data[i];
+    }
+    _last = now;
+}
+
+void NanoCapture::flush()
+{
+    if (_length == 0)
+    {
+        return;
+    }
+    uint8_t header[6];
+    uint8_t size = 0;
+    header[size++] = _direction | (_length - 1) << 1;
+    uint32_t delta = _time - _previous;
+    do
+    {
+        header[size] = delta & 0x7F;
+        delta >>= 7;
+        if (delta)
+        {
+            header[size] |= 0x80;
+        }
+        size++;
+    }
+    while (delta);
+    _sink->write(header, size);
+    _sink->write(_data, _length);
+    _previous = _time;
+    _length = 0;
+}
+
+NanoReplay::NanoReplay(Stream* source)
+{
+    _source = source;
+}
+
+bool NanoReplay::begin()
+{
+    uint8_t header[4];
+    if (_source->readBytes(header, sizeof(header)) != sizeof(header) ||
+        header[0] != 'P' || header[1] != 'N' || header[2] != 'C' ||
+        header[3] != CAPTURE_VERSION)
+    {
+        return false;
+    }
+    _loaded = false;
+    _finished = false;
+    _mismatches = 0;
+    _anchor = micros();
+    return true;
+}
+
+void NanoReplay::setSpeed(float speed)
+{
+    _speed = speed;
+}
+
+uint32_t NanoReplay::getMismatches()
+{
+    return _mismatches;
+}
+
+bool NanoReplay::finished()
+{
+    return _finished;
+}
+
+int NanoReplay::available()
+{
+    if (!loadRecord() ||
+        _direction != CAPTURE_DIRECTION_RX ||
+        !released())
+    {
+        return 0;
+    }
+    return _length - _offset;
+}
+
+int NanoReplay::read()
+{
+    if (available() == 0)
+    {
+        return -1;
+    }
+    uint8_t c = _data[_offset++];
+    if (_offset == _length)
+    {
+        _loaded = false;
+    }
+    return c;
+}
+
+int NanoReplay::peek()
+{
+    if (available() == 0)
+    {
+        return -1;
+    }
+    return _data[_offset];
+}
+
+size_t NanoReplay::write(uint8_t c)
+{
+    // Replies the driver gave up on before they were due are skipped
+    while (loadRecord() &&
+        _direction == CAPTURE_DIRECTION_RX)
+    {
+        _mismatches++;
+        _loaded = false;
+    }
+    if (!_loaded)
+    {
+        _mismatches++;
+        return 1;
+    }
+    if (_offset == 0)
+    {
+        _anchor = micros();
+    }
+    if (_data[_offset] != c)
+    {
+        _mismatches++;
+    }
+    if (++_offset == _length)
+    {
+        _loaded = false;
+    }
+    return 1;
+}
+
+//
+// Private
+//
+
+bool NanoReplay::loadRecord()
+{
+    if (_loaded)
+    {
+        return true;
+    }
+    if (_finished)
+    {
+        return false;
+    }
+    int header = _source->read();
+    if (header < 0)
+    {
+        _finished = true;
+        return false;
+    }
+    _direction = header & 1;
+    _length = (header >> 1) + 1;
+    _delta = 0;
+    uint8_t shift = 0;
+    int c;
+    do
+    {
+        c = _source->read();
+        if (c < 0)
+        {
+            _finished = true;
+            return false;
+        }
+        _delta |= (uint32_t)(c & 0x7F) << shift;
+        shift += 7;
+    }
+    while (c & 0x80);
+    if (_source->readBytes(_data, _length) != _length)
+    {
+        _finished = true;
+        return false;
+    }
+    _offset = 0;
+    _released = false;
+    _loaded = true;
+    return true;
+}
+
+bool NanoReplay::released()
+{
+    if (_released)
+    {
+        return true;
+    }
+    uint32_t elapsed = micros() - _anchor;
+    if (_speed > 0 && elapsed < _delta / _speed)
+    {
+        return false;
+    }
+    // Later records are timed from when this one was due
+    _anchor += _speed > 0 ? (uint32_t)(_delta / _speed) : elapsed;
+    _released = true;
+    return true;
+}
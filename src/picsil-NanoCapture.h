@@ -0,0 +1,84 @@
+#ifndef __picsil_NanoCapture_h__
+#define __picsil_NanoCapture_h__
+#include <Arduino.h>
+
+#define CAPTURE_DIRECTION_TX    0
+#define CAPTURE_DIRECTION_RX    1
+#define CAPTURE_RECORD_SIZE     128
+#define CAPTURE_GAP             1000
+
+// Capture format:
+//   "PNC" <version>
+//   records of <header> <delta> <data>
+// header bit 0 is the direction and bits 1-7 the data length - 1,
+// delta is the time in microseconds since the previous record as a
+// little endian base 128 varint. Bytes in the same direction are merged
+// into one record unless CAPTURE_GAP microseconds pass between them.
+// Times are taken when the driver handles a byte, not when the UART
+// received it. Bytes that wait in the serial buffer, for example
+// between poll() calls, are stamped when they are read, so received
+// timing is only as fine as the driver reads.
+#define CAPTURE_VERSION         1
+
+// Records every byte to and from the module, see setCapture()
+class NanoCapture
+{
+public:
+    NanoCapture(Print* sink);
+
+    void begin();
+    void record(uint8_t direction, const uint8_t* data, size_t length);
+    void flush();
+
+private:
+    Print* _sink;
+    uint8_t _data[CAPTURE_RECORD_SIZE];
+    uint8_t _length = 0;
+    uint8_t _direction = CAPTURE_DIRECTION_TX;
+    uint32_t _time = 0;
+    uint32_t _previous = 0;
+    uint32_t _last = 0;
+};
+
+// Plays a capture back as if it were the module. Pass it to
+// NanoCellular::begin(Stream*) in place of the serial port.
+// Received data is released at the recorded delay after the command
+// before it, divided by the speed, so the driver sees the same timing
+// however fast it runs itself. Commands the driver sends are compared
+// to the capture and differences counted as mismatches.
+class NanoReplay : public Stream
+{
+public:
+    NanoReplay(Stream* source);
+
+    bool begin();
+    // 1.0 is real time, 10.0 ten times faster and 0 without any delay
+    void setSpeed(float speed);
+    uint32_t getMismatches();
+    bool finished();
+
+    int available();
+    int read();
+    int peek();
+    size_t write(uint8_t c);
+    using Print::write;
+
+private:
+    bool loadRecord();
+    bool released();
+
+    Stream* _source;
+    uint8_t _data[CAPTURE_RECORD_SIZE];
+    uint8_t _length = 0;
+    uint8_t _offset = 0;
+    uint8_t _direction = CAPTURE_DIRECTION_TX;
+    uint32_t _delta = 0;
+    bool _loaded = false;
+    bool _released = false;
+    bool _finished = false;
+    uint32_t _anchor = 0;
+    float _speed = 1.0;
+    uint32_t _mismatches = 0;
+};
+
+#endif
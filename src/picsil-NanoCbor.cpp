@@ -0,0 +1,217 @@
+//---------------------------------------------------------------------------------------------
+//
+// CBOR encoder for Nimbelink Skywire Nano cellular modules.
+//
+// Copyright 2020 picsil LLC
+//
+// Licensed under the MIT license, see the LICENSE.txt file.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include <Arduino.h>
+#include "picsil-NanoCbor.h"
+
+#define CBOR_UINT           0
+#define CBOR_NEGINT         1
+#define CBOR_BYTES          2
+#define CBOR_TEXT           3
+#define CBOR_ARRAY          4
+#define CBOR_MAP            5
+#define CBOR_SIMPLE         7
+
+#define CBOR_FALSE          0xF4
+#define CBOR_TRUE           0xF5
+#define CBOR_NULL           0xF6
+#define CBOR_FLOAT32        0xFA
+#define CBOR_FLOAT64        0xFB
+#define CBOR_INDEFINITE     0x1F
+#define CBOR_BREAK          0xFF
+
+NanoCbor::NanoCbor(NanoCellular* cell)
+{
+    _cell = cell;
+}
+
+bool NanoCbor::beginMap(uint16_t count)
+{
+    return writeHeader(CBOR_MAP, count);
+}
+
+bool NanoCbor::beginMap()
+{
+    uint8_t header = CBOR_MAP << 5 | CBOR_INDEFINITE;
+    return writeBytes(&header, 1);
+}
+
+bool NanoCbor::beginArray(uint16_t count)
+{
+    return writeHeader(CBOR_ARRAY, count);
+}
+
+bool NanoCbor::beginArray()
+{
+    uint8_t header = CBOR_ARRAY << 5 | CBOR_INDEFINITE;
+    return writeBytes(&header, 1);
+}
+
+bool NanoCbor::end()
+{
+    uint8_t header = CBOR_BREAK;
+    return writeBytes(&header, 1);
+}
+
+bool NanoCbor::addUint(uint64_t value)
+{
+    return writeHeader(CBOR_UINT, value);
+}
+
+bool NanoCbor::addInt(int64_t value)
+{
+    if (value < 0)
+    {
+        // Negative integers are stored as -1 - n
+        return writeHeader(CBOR_NEGINT, (uint64_t)(-1 - value));
+    }
+    return writeHeader(CBOR_UINT, value);
+}
+
+bool NanoCbor::addFloat(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint8_t data[5] = { CBOR_FLOAT32, (uint8_t)(bits >> 24), (uint8_t)(bits >> 16), (uint8_t)(bits >> 8), (uint8_t)bits };
+    return writeBytes(data, sizeof(data));
+}
+
+bool NanoCbor::addDouble(double value)
+{
+    // AVR doubles are only 4 bytes
+    if (sizeof(double) != 8)
+    {
+        return addFloat(value);
+    }
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint8_t data[9];
+    data[0] = CBOR_FLOAT64;
+    for (uint8_t i = 0; i < 8; i++)
+    {
+        data[8 - i] = bits >> (i * 8);
+    }
+    return writeBytes(data, sizeof(data));
+}
+
+bool NanoCbor::addBool(bool value)
+{
+    uint8_t header = value ? CBOR_TRUE : CBOR_FALSE;
+    return writeBytes(&header, 1);
+}
+
+bool NanoCbor::addNull()
+{
+    uint8_t header = CBOR_NULL;
+    return writeBytes(&header, 1);
+}
+
+bool NanoCbor::addString(const char* value)
+{
+    size_t length = strlen(value);
+    return writeHeader(CBOR_TEXT, length) &&
+        writeBytes((const uint8_t*)value, length);
+}
+
+bool NanoCbor::addBytes(const uint8_t* value, size_t length)
+{
+    return writeHeader(CBOR_BYTES, length) &&
+        writeBytes(value, length);
+}
+
+bool NanoCbor::flush()
+{
+    if (!_cell->flushTx())
+    {
+        _error = true;
+    }
+    return !_error;
+}
+
+uint32_t NanoCbor::getLength()
+{
+    return _length;
+}
+
+bool NanoCbor::getError()
+{
+    return _error;
+}
+
+//
+// Private
+//
+
+bool NanoCbor::writeHeader(uint8_t major, uint64_t value)
+{
+    // Values below 24 fit in the header byte, larger ones follow it
+    // in the smallest of 1, 2, 4 or 8 big endian bytes
+    uint8_t data[9];
+    uint8_t length;
+    if (value < 24)
+    {
+        data[0] = major << 5 | value;
+        return writeBytes(data, 1);
+    }
+    if (value <= 0xFF)
+    {
+        data[0] = major << 5 | 24;
+        length = 1;
+    }
+    else if (value <= 0xFFFF)
+    {
+        data[0] = major << 5 | 25;
+        length = 2;
+    }
+    else if (value <= 0xFFFFFFFF)
+    {
+        data[0] = major << 5 | 26;
+        length = 4;
+    }
+    else
+    {
+        data[0] = major << 5 | 27;
+        length = 8;
+    }
+    for (uint8_t i = 0; i < length; i++)
+    {
+        data[length - i] = value >> (i * 8);
+    }
+    return writeBytes(data, length + 1);
+}
+
+bool NanoCbor::writeBytes(const uint8_t* data, size_t length)
+{
+    if (_error)
+    {
+        return false;
+    }
+    while (length > 0)
+    {
+        size_t free;
+        uint8_t* buffer = _cell->getTxBuffer(&free);
+        if (buffer == nullptr)
+        {
+            _error = true;
+            return false;
+        }
+        size_t part = length < free ? length : free;
+        memcpy(buffer, data, part);
+        if (!_cell->commitTx(part))
+        {
+            _error = true;
+            return false;
+        }
+        data += part;
+        length -= part;
+        _length += part;
+    }
+    return true;
+}
@@ -0,0 +1,44 @@
+#ifndef __picsil_NanoCbor_h__
+#define __picsil_NanoCbor_h__
+#include <Arduino.h>
+#include "picsil-Nano.h"
+
+// CBOR encoder writing straight into the transmit buffer of a module.
+// Nothing is allocated, when the buffer fills it is sent and encoding
+// continues, so a message of any size needs no RAM of its own.
+// Call flush() when the message is complete.
+class NanoCbor
+{
+public:
+    NanoCbor(NanoCellular* cell);
+
+    // Containers with a known count, or indefinite ones closed by end()
+    bool beginMap(uint16_t count);
+    bool beginMap();
+    bool beginArray(uint16_t count);
+    bool beginArray();
+    bool end();
+
+    bool addUint(uint64_t value);
+    bool addInt(int64_t value);
+    bool addFloat(float value);
+    bool addDouble(double value);
+    bool addBool(bool value);
+    bool addNull();
+    bool addString(const char* value);
+    bool addBytes(const uint8_t* value, size_t length);
+
+    bool flush();
+    uint32_t getLength();
+    bool getError();
+
+private:
+    bool writeHeader(uint8_t major, uint64_t value);
+    bool writeBytes(const uint8_t* data, size_t length);
+
+    NanoCellular* _cell;
+    uint32_t _length = 0;
+    bool _error = false;
+};
+
+#endif
@@ -0,0 +1,129 @@
+//---------------------------------------------------------------------------------------------
+//
+// Multi module driver for Nimbelink Skywire Nano cellular modules.
+//
+// Copyright 2020 picsil LLC
+//
+// Licensed under the MIT license, see the LICENSE.txt file.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include <Arduino.h>
+#include "picsil-NanoFleet.h"
+
+bool NanoFleet::addModem(NanoCellular* modem, uint8_t weight)
+{
+    if (_count >= FLEET_MAX_MODEMS || weight == 0)
+    {
+        return false;
+    }
+    _modems[_count] = modem;
+    _weights[_count] = weight;
+    _current[_count] = 0;
+    _dispatched[_count] = 0;
+    _count++;
+    return true;
+}
+
+uint8_t NanoFleet::getModemCount()
+{
+    return _count;
+}
+
+NanoCellular* NanoFleet::getModem(uint8_t index)
+{
+    if (index >= _count)
+    {
+        return nullptr;
+    }
+    return _modems[index];
+}
+
+bool NanoFleet::write(const uint8_t* data, uint8_t length)
+{
+    int8_t index = selectModem();
+    if (index < 0 ||
+        !_modems[index]->queueRecord(data, length))
+    {
+        _rejected++;
+        return false;
+    }
+    _dispatched[index]++;
+    return true;
+}
+
+void NanoFleet::poll()
+{
+    // Queue sends only start or pick up replies here, so every module
+    // is serviced each call and their transfers overlap
+    for (uint8_t i = 0; i < _count; i++)
+    {
+        _modems[i]->poll();
+    }
+}
+
+uint32_t NanoFleet::getDispatched(uint8_t index)
+{
+    if (index >= _count)
+    {
+        return 0;
+    }
+    return _dispatched[index];
+}
+
+void NanoFleet::getStats(FleetStats* stats)
+{
+    memset(stats, 0, sizeof(FleetStats));
+    stats->modems = _count;
+    stats->rejected = _rejected;
+    for (uint8_t i = 0; i < _count; i++)
+    {
+        if (_modems[i]->isLinkUp())
+        {
+            stats->linked++;
+        }
+        stats->dispatched += _dispatched[i];
+        stats->queued += _modems[i]->getQueuedRecords();
+        stats->dropped += _modems[i]->getDroppedRecords();
+    }
+}
+
+//
+// Private
+//
+
+int8_t NanoFleet::selectModem()
+{
+    // Smooth weighted round robin over the modules with a working link,
+    // or over all of them when every link is down so records still queue
+    bool anyLinked = false;
+    for (uint8_t i = 0; i < _count; i++)
+    {
+        if (_modems[i]->isLinkUp())
+        {
+            anyLinked = true;
+            break;
+        }
+    }
+
+    int8_t best = -1;
+    int16_t total = 0;
+    for (uint8_t i = 0; i < _count; i++)
+    {
+        if (anyLinked && !_modems[i]->isLinkUp())
+        {
+            continue;
+        }
+        _current[i] += _weights[i];
+        total += _weights[i];
+        if (best < 0 || _current[i] > _current[best])
+        {
+            best = i;
+        }
+    }
+    if (best >= 0)
+    {
+        _current[best] -= total;
+    }
+    return best;
+}
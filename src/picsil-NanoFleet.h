@@ -0,0 +1,46 @@
+#ifndef __picsil_NanoFleet_h__
+#define __picsil_NanoFleet_h__
+#include <Arduino.h>
+#include "picsil-Nano.h"
+
+#define FLEET_MAX_MODEMS    4
+
+struct FleetStats
+{
+    uint8_t modems;
+    uint8_t linked;
+    uint32_t dispatched;
+    uint32_t rejected;
+    uint16_t queued;
+    uint16_t dropped;
+};
+
+// Drives several modules from one loop. Outbound records are spread
+// over the modules by weighted round robin into their store and forward
+// queues. poll() services every module, each one waiting on the reply
+// to its queue send without blocking, so sends on all of them overlap.
+class NanoFleet
+{
+public:
+    bool addModem(NanoCellular* modem, uint8_t weight = 1);
+    uint8_t getModemCount();
+    NanoCellular* getModem(uint8_t index);
+
+    bool write(const uint8_t* data, uint8_t length);
+    void poll();
+
+    uint32_t getDispatched(uint8_t index);
+    void getStats(FleetStats* stats);
+
+private:
+    int8_t selectModem();
+
+    NanoCellular* _modems[FLEET_MAX_MODEMS];
+    uint8_t _weights[FLEET_MAX_MODEMS];
+    int16_t _current[FLEET_MAX_MODEMS];
+    uint32_t _dispatched[FLEET_MAX_MODEMS];
+    uint32_t _rejected = 0;
+    uint8_t _count = 0;
+};
+
+#endif
@@ -0,0 +1,178 @@
+//---------------------------------------------------------------------------------------------
+//
+// Streaming LZSS codec for Nimbelink Skywire Nano cellular modules.
+//
+// Copyright 2020 picsil LLC
+//
+// Licensed under the MIT license, see the LICENSE.txt file.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include <Arduino.h>
+#include "picsil-NanoLz.h"
+
+void NanoLz::reset()
+{
+    memset(_encodeWindow, 0, sizeof(_encodeWindow));
+    memset(_encodeHead, 0, sizeof(_encodeHead));
+    _encodePosition = 0;
+
+    memset(_decodeWindow, 0, sizeof(_decodeWindow));
+    _decodePosition = 0;
+    _frameRemaining = 0;
+    _flagBits = 0;
+    _haveHigh = false;
+    _matchRemaining = 0;
+
+    blockLength = 0;
+}
+
+uint16_t NanoLz::compress(const uint8_t* input, uint16_t length, uint8_t* frame)
+{
+    if (length > LZ_BLOCK_SIZE)
+    {
+        length = LZ_BLOCK_SIZE;
+    }
+
+    uint16_t out = 1;
+    uint16_t flagIndex = 0;
+    uint8_t flagBit = 8;
+    uint16_t i = 0;
+    while (i < length)
+    {
+        if (flagBit == 8)
+        {
+            flagIndex = out++;
+            frame[flagIndex] = 0;
+            flagBit = 0;
+        }
+
+        // Positions wrap at 64k, the bytes are compared anyway so a
+        // stale hash entry can only cost a missed match
+        uint16_t bestLength = 0;
+        uint16_t distance = 0;
+        if (i + LZ_MIN_MATCH <= length)
+        {
+            uint8_t h = hash(input + i);
+            distance = _encodePosition - _encodeHead[h];
+            _encodeHead[h] = _encodePosition;
+            if (distance > 0 && distance <= LZ_WINDOW_SIZE)
+            {
+                uint16_t limit = length - i;
+                if (limit > LZ_MAX_MATCH)
+                {
+                    limit = LZ_MAX_MATCH;
+                }
+                while (bestLength < limit)
+                {
+                    // Matches may run into the bytes being encoded
+                    uint8_t c = bestLength < distance
+                        ? _encodeWindow[(uint16_t)(_encodePosition - distance + bestLength) % LZ_WINDOW_SIZE]
+                        : input[i + bestLength - distance];
+                    if (c != input[i + bestLength])
+                    {
+                        break;
+                    }
+                    bestLength++;
+                }
+            }
+        }
+
+        if (bestLength >= LZ_MIN_MATCH)
+        {
+            uint16_t code = ((distance - 1) << 6) | (bestLength - LZ_MIN_MATCH);
+            frame[flagIndex] |= 1 << flagBit;
+            frame[out++] = code >> 8;
+            frame[out++] = code & 0xFF;
+        }
+        else
+        {
+            bestLength = 1;
+            frame[out++] = input[i];
+        }
+        flagBit++;
+
+        for (uint16_t j = 0; j < bestLength; j++)
+        {
+            if (j > 0 && i + LZ_MIN_MATCH <= length)
+            {
+                _encodeHead[hash(input + i)] = _encodePosition;
+            }
+            _encodeWindow[_encodePosition % LZ_WINDOW_SIZE] = input[i];
+            _encodePosition++;
+            i++;
+        }
+    }
+
+    frame[0] = out - 1;
+    return out;
+}
+
+uint16_t NanoLz::decompress(const uint8_t* input, uint16_t length, uint16_t* consumed, uint8_t* output, uint16_t size)
+{
+    uint16_t in = 0;
+    uint16_t out = 0;
+    while (out < size)
+    {
+        if (_matchRemaining > 0)
+        {
+            emit(_decodeWindow[(uint16_t)(_decodePosition - _matchDistance) % LZ_WINDOW_SIZE], output + out++);
+            _matchRemaining--;
+            continue;
+        }
+        if (in >= length)
+        {
+            break;
+        }
+        if (_frameRemaining == 0)
+        {
+            _frameRemaining = input[in++];
+            _flagBits = 0;
+            continue;
+        }
+        _frameRemaining--;
+        if (_flagBits == 0)
+        {
+            _flags = input[in++];
+            _flagBits = 8;
+            continue;
+        }
+        if (_flags & 1)
+        {
+            if (!_haveHigh)
+            {
+                _high = input[in++];
+                _haveHigh = true;
+                continue;
+            }
+            uint16_t code = (_high << 8) | input[in++];
+            _haveHigh = false;
+            _matchDistance = (code >> 6) + 1;
+            _matchRemaining = (code & 0x3F) + LZ_MIN_MATCH;
+        }
+        else
+        {
+            emit(input[in++], output + out++);
+        }
+        _flags >>= 1;
+        _flagBits--;
+    }
+    *consumed = in;
+    return out;
+}
+
+//
+// Private
+//
+
+uint8_t NanoLz::hash(const uint8_t* data)
+{
+    return (data[0] * 33 + data[1] * 7 + data[2]) & (LZ_HASH_SIZE - 1);
+}
+
+void NanoLz::emit(uint8_t c, uint8_t* output)
+{
+    *output = c;
+    _decodeWindow[_decodePosition % LZ_WINDOW_SIZE] = c;
+    _decodePosition++;
+}
@@ -0,0 +1,58 @@
+#ifndef __picsil_NanoLz_h__
+#define __picsil_NanoLz_h__
+#include <Arduino.h>
+
+#define LZ_WINDOW_SIZE      1024
+#define LZ_HASH_SIZE        256
+#define LZ_MIN_MATCH        3
+#define LZ_MAX_MATCH        66
+#define LZ_BLOCK_SIZE       128
+#define LZ_FRAME_SIZE       (LZ_BLOCK_SIZE + LZ_BLOCK_SIZE / 8 + 2)
+
+// Streaming LZSS codec for one connection, about 2.8 KB of RAM.
+//
+// Data is sent as frames of <length><body>, each body holding groups
+// of a flag byte and up to 8 items. A clear flag bit is a literal byte,
+// a set bit a 2 byte match of a 10 bit distance and 6 bit length.
+// Both sides keep their window across frames, so later frames refer
+// back to data sent earlier on the same connection.
+class NanoLz
+{
+public:
+    void reset();
+
+    // Compresses up to LZ_BLOCK_SIZE bytes into one frame of at most
+    // LZ_FRAME_SIZE bytes, returns the frame length
+    uint16_t compress(const uint8_t* input, uint16_t length, uint8_t* frame);
+    // Decodes as much as fits in output, returns the bytes produced and
+    // the input used in *consumed. Input may be split at any point.
+    uint16_t decompress(const uint8_t* input, uint16_t length, uint16_t* consumed, uint8_t* output, uint16_t size);
+
+    // Buffers used by the driver, written data is collected in block
+    // until it is full or flushed
+    uint8_t frame[LZ_FRAME_SIZE];
+    uint8_t block[LZ_BLOCK_SIZE];
+    uint16_t blockLength;
+
+private:
+    uint8_t hash(const uint8_t* data);
+    void emit(uint8_t c, uint8_t* output);
+
+    // Encoder
+    uint8_t _encodeWindow[LZ_WINDOW_SIZE];
+    uint16_t _encodeHead[LZ_HASH_SIZE];
+    uint16_t _encodePosition;
+
+    // Decoder
+    uint8_t _decodeWindow[LZ_WINDOW_SIZE];
+    uint16_t _decodePosition;
+    uint8_t _frameRemaining;
+    uint8_t _flags;
+    uint8_t _flagBits;
+    bool _haveHigh;
+    uint8_t _high;
+    uint16_t _matchDistance;
+    uint8_t _matchRemaining;
+};
+
+#endif
@@ -0,0 +1,161 @@
+//---------------------------------------------------------------------------------------------
+//
+// Store and forward queue for Nimbelink Skywire Nano cellular modules.
+//
+// Copyright 2020 picsil LLC
+//
+// Licensed under the MIT license, see the LICENSE.txt file.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include <Arduino.h>
+#include "picsil-NanoQueue.h"
+
+bool NanoQueue::push(const uint8_t* data, uint8_t length)
+{
+    if (length == 0)
+    {
+        return false;
+    }
+
+    // Keep the order: once records are spilled, the rest follow them
+    if (_storage != nullptr &&
+        (_storage->count() > 0 || _used + length + 1 > QUEUE_BUFFER_SIZE))
+    {
+        if (_storage->push(data, length))
+        {
+            return true;
+        }
+        if (_storage->count() > 0)
+        {
+            _dropped++;
+            return false;
+        }
+    }
+
+    // No room left, the newest data is worth more than the oldest
+    while (_used + length + 1 > QUEUE_BUFFER_SIZE)
+    {
+        removeOldest();
+        _dropped++;
+    }
+
+    uint16_t tail = (_head + _used) % QUEUE_BUFFER_SIZE;
+    _ring[tail] = length;
+    for (uint16_t i = 0; i < length; i++)
+    {
+        _ring[(tail + 1 + i) % QUEUE_BUFFER_SIZE] = data[i];
+    }
+    _used += length + 1;
+    _records++;
+    return true;
+}
+
+uint16_t NanoQueue::fill(uint8_t* buffer, uint16_t size, uint16_t* records)
+{
+    uint16_t length = 0;
+    uint16_t position = _head;
+    *records = 0;
+
+    // Oldest records are in the ring
+    while (*records < _records)
+    {
+        uint8_t recordLength = _ring[position];
+        if (length + recordLength + 1 > size)
+        {
+            return length;
+        }
+        copyOut(position, buffer + length, recordLength + 1);
+        length += recordLength + 1;
+        position = (position + recordLength + 1) % QUEUE_BUFFER_SIZE;
+        (*records)++;
+    }
+
+    if (_storage == nullptr)
+    {
+        return length;
+    }
+
+    uint16_t index = 0;
+    while (index < _storage->count())
+    {
+        if (length + 1 >= size)
+        {
+            break;
+        }
+        uint16_t free = size - length - 1;
+        uint8_t recordLength = _storage->read(index, buffer + length + 1, free > 255 ? 255 : free);
+        if (recordLength == 0 || recordLength > free)
+        {
+            break;
+        }
+        buffer[length] = recordLength;
+        length += recordLength + 1;
+        index++;
+        (*records)++;
+    }
+    return length;
+}
+
+void NanoQueue::remove(uint16_t records)
+{
+    while (records > 0 && _records > 0)
+    {
+        removeOldest();
+        records--;
+    }
+    if (records > 0 && _storage != nullptr)
+    {
+        _storage->remove(records);
+    }
+}
+
+void NanoQueue::clear()
+{
+    if (_storage != nullptr)
+    {
+        _storage->remove(_storage->count());
+    }
+    _head = 0;
+    _used = 0;
+    _records = 0;
+}
+
+uint16_t NanoQueue::count()
+{
+    if (_storage != nullptr)
+    {
+        return _records + _storage->count();
+    }
+    return _records;
+}
+
+uint16_t NanoQueue::getDropped()
+{
+    return _dropped;
+}
+
+void NanoQueue::setStorage(NanoQueueStorage* storage)
+{
+    _storage = storage;
+}
+
+//
+// Private
+//
+
+void NanoQueue::copyOut(uint16_t position, uint8_t* buffer, uint16_t length)
+{
+    for (uint16_t i = 0; i < length; i++)
+    {
+        buffer[i] = _ring[(position + i) % QUEUE_BUFFER_SIZE];
+    }
+}
+
+void NanoQueue::removeOldest()
+{
+    uint8_t length = _ring[_head];
+    _head = (_head + length + 1) % QUEUE_BUFFER_SIZE;
+    _used -= length + 1;
+    _records--;
+}
@@ -0,0 +1,53 @@
+#ifndef __picsil_NanoQueue_h__
+#define __picsil_NanoQueue_h__
+#include <Arduino.h>
+
+#define QUEUE_BUFFER_SIZE   512
+#define QUEUE_BATCH_SIZE    256
+
+// Optional backend records are spilled to when the RAM ring is full,
+// for example a file on an SD card or a region of external flash.
+// Records must be returned in the order they were pushed.
+class NanoQueueStorage
+{
+public:
+    virtual bool push(const uint8_t* data, uint8_t length) = 0;
+    // Copies record number <index> (0 is the oldest) into buffer and
+    // returns its length, or 0 if there is no such record.
+    virtual uint8_t read(uint16_t index, uint8_t* buffer, uint8_t length) = 0;
+    // Removes the <records> oldest records.
+    virtual void remove(uint16_t records) = 0;
+    virtual uint16_t count() = 0;
+};
+
+// Store and forward queue of length prefixed records.
+// Records live in a fixed size RAM ring, and go to the storage backend
+// once the ring is full. While the backend holds records, new records
+// are appended there as well so the upload order is preserved.
+class NanoQueue
+{
+public:
+    bool push(const uint8_t* data, uint8_t length);
+    // Copies as many whole records as fit into buffer, each one still
+    // preceded by its length byte so the batch can be split again.
+    uint16_t fill(uint8_t* buffer, uint16_t size, uint16_t* records);
+    void remove(uint16_t records);
+    void clear();
+
+    uint16_t count();
+    uint16_t getDropped();
+    void setStorage(NanoQueueStorage* storage);
+
+private:
+    void copyOut(uint16_t position, uint8_t* buffer, uint16_t length);
+    void removeOldest();
+
+    uint8_t _ring[QUEUE_BUFFER_SIZE];
+    uint16_t _head = 0;
+    uint16_t _used = 0;
+    uint16_t _records = 0;
+    uint16_t _dropped = 0;
+    NanoQueueStorage* _storage = nullptr;
+};
+
+#endif
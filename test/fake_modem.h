@@ -0,0 +1,173 @@
+#ifndef __test_fake_modem_h__
+#define __test_fake_modem_h__
+#include <Arduino.h>
+#include <ctype.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+// Answers the commands the driver sends the way the Serial LTE Modem
+// firmware does, each reply due a set time after its command.
+class FakeModem : public Stream
+{
+public:
+    // Delay of the #XTCPSEND reply in milliseconds
+    unsigned long latency = 1000;
+    // Number of AT#XTCPSEND commands seen
+    int sends = 0;
+    // Bytes the driver sent on the socket
+    std::vector<uint8_t> received;
+    // Bytes waiting for the driver to receive
+    std::vector<uint8_t> incoming;
+
+    int available()
+    {
+        int count = 0;
+        for (auto& pending : _rx)
+        {
+            if (pending.due > millis())
+            {
+                break;
+            }
+            count++;
+        }
+        return count;
+    }
+
+    int read()
+    {
+        if (available() == 0)
+        {
+            return -1;
+        }
+        uint8_t c = _rx.front().c;
+        _rx.pop_front();
+        return c;
+    }
+
+    int peek()
+    {
+        return available() > 0 ? _rx.front().c : -1;
+    }
+
+    size_t write(uint8_t c)
+    {
+        if (c == '\r')
+        {
+            return 1;
+        }
+        if (c != '\n')
+        {
+            _line += (char)c;
+            return 1;
+        }
+        command(_line);
+        _line.clear();
+        return 1;
+    }
+    using Print::write;
+
+    // Queues text for the driver, due at millis() + delay at the earliest
+    void reply(const std::string& text, unsigned long delay)
+    {
+        unsigned long due = millis() + delay;
+        if (!_rx.empty() && _rx.back().due > due)
+        {
+            due = _rx.back().due;
+        }
+        for (char c : text)
+        {
+            _rx.push_back({ due, (uint8_t)c });
+        }
+    }
+
+private:
+    struct Pending
+    {
+        unsigned long due;
+        uint8_t c;
+    };
+
+    void command(const std::string& line)
+    {
+        if (line.compare(0, 12, "AT#XTCPSEND=") == 0)
+        {
+            // AT#XTCPSEND=<handle>,0,"<hex>"
+            size_t quote = line.find('"');
+            std::string hex = line.substr(quote + 1, line.size() - quote - 2);
+            for (size_t i = 0; i < hex.size(); i += 2)
+            {
+                received.push_back(strtol(hex.substr(i, 2).c_str(), nullptr, 16));
+            }
+            reply("\r\n#XTCPSEND: " + std::to_string(hex.size() / 2) + "\r\n\r\nOK\r\n", latency);
+            sends++;
+        }
+        else if (line.compare(0, 12, "AT#XTCPRECV=") == 0)
+        {
+            receive(line);
+        }
+        else if (line == "AT#XSOCKET=1,1,0")
+        {
+            reply("\r\n#XSOCKET: 2,1,6\r\n\r\nOK\r\n", 50);
+        }
+        else if (line.compare(0, 12, "AT#XTCPCONN=") == 0)
+        {
+            reply("\r\n#XTCPCONN: 1\r\n\r\nOK\r\n", 2000);
+        }
+        else if (line == "AT+CEREG?")
+        {
+            reply("\r\n+CEREG: 1,1\r\n\r\nOK\r\n", 5);
+        }
+        else if (line == "AT%XMONITOR")
+        {
+            reply("\r\n%XMONITOR: 1,\"Operator\",\"Op\",\"26201\",\"00B7\",7,20,\"00011B07\","
+                "7,2300,63,39,\"\",\"11100000\",\"11100000\",\"01001001\"\r\n\r\nOK\r\n", 30);
+        }
+        else
+        {
+            reply("\r\nOK\r\n", 5);
+        }
+    }
+
+    void receive(const std::string& line)
+    {
+        // AT#XTCPRECV=<handle>,<size>,<timeout>
+        if (incoming.empty())
+        {
+            reply("\r\nERROR\r\n", 20);
+            return;
+        }
+        size_t length = atoi(line.c_str() + line.find(',') + 1);
+        if (length > incoming.size())
+        {
+            length = incoming.size();
+        }
+        // Data goes as text when it all prints, hex otherwise. A URC
+        // comes ahead of it, as one can on the real module.
+        bool text = true;
+        for (size_t i = 0; i < length; i++)
+        {
+            text &= isprint(incoming[i]) || isspace(incoming[i]);
+        }
+        std::string data = "\r\n+CEREG: 5\r\n";
+        for (size_t i = 0; i < length; i++)
+        {
+            if (text)
+            {
+                data += (char)incoming[i];
+                continue;
+            }
+            char hex[3];
+            sprintf(hex, "%02X", incoming[i]);
+            data += hex;
+        }
+        data += "\r\n#XTCPRECV: " + std::string(text ? "1," : "0,") + std::to_string(length) + "\r\n\r\nOK\r\n";
+        incoming.erase(incoming.begin(), incoming.begin() + length);
+        reply(data, 20);
+    }
+
+    std::deque<Pending> _rx;
+    std::string _line;
+};
+
+#endif
@@ -0,0 +1,152 @@
+#include <Arduino.h>
+#include <Ethernet.h>
+#include <HardwareSerial.h>
+#include <M2M_Logger.h>
+#include <stdarg.h>
+
+// Starts well past zero, the driver treats time 0 as long ago
+static uint64_t hostTime = 20000000;
+
+void pinMode(int, int) {}
+void digitalWrite(int, int) {}
+int digitalRead(int) { return LOW; }
+int digitalPinToInterrupt(int pin) { return pin; }
+void attachInterrupt(int, void (*)(), int) {}
+void detachInterrupt(int) {}
+void noInterrupts() {}
+void interrupts() {}
+
+void delay(unsigned long ms)
+{
+    hostTime += ms * 1000ULL;
+}
+
+unsigned long millis()
+{
+    return hostTime / 1000;
+}
+
+unsigned long micros()
+{
+    return hostTime;
+}
+
+void hostAdvance(unsigned long ms)
+{
+    hostTime += ms * 1000ULL;
+}
+
+long random(long max)
+{
+    return max > 0 ? rand() % max : 0;
+}
+
+long random(long min, long max)
+{
+    return min + random(max - min);
+}
+
+void randomSeed(unsigned long seed)
+{
+    srand(seed);
+}
+
+size_t Print::write(const uint8_t* buffer, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        write(buffer[i]);
+    }
+    return size;
+}
+
+size_t Print::print(const char* text)
+{
+    return write((const uint8_t*)text, strlen(text));
+}
+
+size_t Print::println(const char* text)
+{
+    return print(text) + write((const uint8_t*)"\r\n", 2);
+}
+
+size_t Stream::readBytes(uint8_t* buffer, size_t length)
+{
+    size_t count = 0;
+    while (count < length)
+    {
+        int c = read();
+        if (c < 0)
+        {
+            break;
+        }
+        buffer[count++] = c;
+    }
+    return count;
+}
+
+IPAddress::IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d)
+{
+    _address[0] = a;
+    _address[1] = b;
+    _address[2] = c;
+    _address[3] = d;
+}
+
+uint8_t IPAddress::operator[](int index) const
+{
+    return _address[index & 3];
+}
+
+void HardwareSerial::begin(unsigned long) {}
+int HardwareSerial::available() { return 0; }
+int HardwareSerial::read() { return -1; }
+int HardwareSerial::peek() { return -1; }
+size_t HardwareSerial::write(uint8_t) { return 1; }
+
+#define LOG_LINE(prefix) \
+    va_list args; \
+    va_start(args, format); \
+    fputs(prefix, stderr); \
+    vfprintf(stderr, format, args); \
+    fputc('\n', stderr); \
+    va_end(args)
+
+void Logger::error(const char* format, ...) { LOG_LINE("E "); }
+void Logger::info(const char* format, ...) { LOG_LINE("I "); }
+void Logger::debug(const char* format, ...) { LOG_LINE("D "); }
+void Logger::trace(const char* format, ...) { LOG_LINE("T "); }
+void Logger::traceStart(const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    fputs("T ", stderr);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
+void Logger::tracePart(const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
+void Logger::traceEnd(const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    fputc('\n', stderr);
+    va_end(args);
+}
+void Logger::tracePartHexDump(const void* data, int length)
+{
+    for (int i = 0; i < length; i++)
+    {
+        fprintf(stderr, "%02X ", ((const uint8_t*)data)[i]);
+    }
+}
+void Logger::tracePartAsciiDump(const void* data, int length)
+{
+    fwrite(data, 1, length, stderr);
+}
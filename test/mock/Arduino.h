@@ -0,0 +1,70 @@
+// Host stand-in for the Arduino core, just what the driver uses
+#ifndef __host_Arduino_h__
+#define __host_Arduino_h__
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+typedef bool boolean;
+#define HIGH            1
+#define LOW             0
+#define INPUT           0
+#define OUTPUT          1
+#define INPUT_PULLUP    2
+#define FALLING         2
+#define RISING          3
+#define CHANGE          4
+
+void pinMode(int pin, int mode);
+void digitalWrite(int pin, int value);
+int digitalRead(int pin);
+int digitalPinToInterrupt(int pin);
+void attachInterrupt(int interrupt, void (*isr)(), int mode);
+void detachInterrupt(int interrupt);
+void noInterrupts();
+void interrupts();
+
+// Time is simulated. It only moves on delay() and hostAdvance(), so a
+// run gives the same result every time.
+void delay(unsigned long ms);
+unsigned long millis();
+unsigned long micros();
+void hostAdvance(unsigned long ms);
+
+long random(long max);
+long random(long min, long max);
+void randomSeed(unsigned long seed);
+
+template<class T> T min(T a, T b)
+{
+    return a < b ? a : b;
+}
+template<class T> T max(T a, T b)
+{
+    return a > b ? a : b;
+}
+
+class __FlashStringHelper;
+
+class Print
+{
+public:
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t* buffer, size_t size);
+    size_t print(const char* text);
+    size_t println(const char* text);
+    virtual void flush() {}
+};
+
+class Stream : public Print
+{
+public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+    size_t readBytes(uint8_t* buffer, size_t length);
+};
+
+#endif
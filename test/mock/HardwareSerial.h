@@ -0,0 +1,16 @@
+#ifndef __host_HardwareSerial_h__
+#define __host_HardwareSerial_h__
+#include <Arduino.h>
+
+class HardwareSerial : public Stream
+{
+public:
+    void begin(unsigned long baud);
+    int available();
+    int read();
+    int peek();
+    size_t write(uint8_t c);
+    using Print::write;
+};
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef __host_M2M_Logger_h__
+#define __host_M2M_Logger_h__
+
+// Prints everything when a test sets one with setLogger()
+class Logger
+{
+public:
+    void error(const char* format, ...);
+    void info(const char* format, ...);
+    void debug(const char* format, ...);
+    void trace(const char* format, ...);
+    void traceStart(const char* format, ...);
+    void tracePart(const char* format, ...);
+    void traceEnd(const char* format, ...);
+    void tracePartHexDump(const void* data, int length);
+    void tracePartAsciiDump(const void* data, int length);
+};
+
+#endif
@@ -0,0 +1,3 @@
+#ifndef __host_SPI_h__
+#define __host_SPI_h__
+#endif
@@ -0,0 +1,52 @@
+// Records captures/session.pnc from the session run against the
+// simulated module. Only needed when the session or the driver's
+// commands change on purpose.
+#include "fake_modem.h"
+#define private public
+#include "picsil-Nano.h"
+#include "session.h"
+#undef private
+
+class FilePrint : public Print
+{
+public:
+    FilePrint(FILE* file)
+    {
+        _file = file;
+    }
+
+    size_t write(uint8_t c)
+    {
+        return fputc(c, _file) == EOF ? 0 : 1;
+    }
+    using Print::write;
+
+private:
+    FILE* _file;
+};
+
+int main(int argc, char** argv)
+{
+    const char* path = argc > 1 ? argv[1] : "captures/session.pnc";
+    FILE* file = fopen(path, "wb");
+    if (file == nullptr)
+    {
+        fprintf(stderr, "Cannot write %s\n", path);
+        return 1;
+    }
+    FilePrint sink(file);
+    NanoCapture capture(&sink);
+    FakeModem modem;
+    NanoCellular cell;
+    const char* reply = SESSION_REPLY;
+    modem.incoming.assign(reply, reply + strlen(reply));
+    attachSession(cell, &modem);
+    cell.setCapture(&capture);
+
+    SessionResult result;
+    runSession(cell, &result);
+    capture.flush();
+    fclose(file);
+    printf("Recorded %s, %zu bytes sent\n", path, modem.received.size());
+    return 0;
+}
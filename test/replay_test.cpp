@@ -0,0 +1,109 @@
+// Replays a capture into the driver running the session it was recorded
+// from. Any change in the commands the driver sends shows up as
+// mismatches, and the simulated time taken compares speeds of a run.
+//   replay_test [capture] [speed]
+// Without a speed it runs at the recorded timing and without delays.
+#include <vector>
+#include "fake_modem.h"
+#define private public
+#include "picsil-Nano.h"
+#include "session.h"
+#undef private
+
+class MemoryStream : public Stream
+{
+public:
+    std::vector<uint8_t> data;
+
+    int available()
+    {
+        return data.size() - _position;
+    }
+
+    int read()
+    {
+        return _position < data.size() ? data[_position++] : -1;
+    }
+
+    int peek()
+    {
+        return _position < data.size() ? data[_position] : -1;
+    }
+
+    size_t write(uint8_t)
+    {
+        return 0;
+    }
+    using Print::write;
+
+private:
+    size_t _position = 0;
+};
+
+static bool load(const char* path, MemoryStream* stream)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == nullptr)
+    {
+        return false;
+    }
+    int c;
+    while ((c = fgetc(file)) != EOF)
+    {
+        stream->data.push_back(c);
+    }
+    fclose(file);
+    return true;
+}
+
+static bool replay(const char* path, float speed)
+{
+    MemoryStream source;
+    if (!load(path, &source))
+    {
+        printf("Cannot read %s\n", path);
+        return false;
+    }
+    NanoReplay replay(&source);
+    if (!replay.begin())
+    {
+        printf("%s is not a capture\n", path);
+        return false;
+    }
+    replay.setSpeed(speed);
+    NanoCellular cell;
+    attachSession(cell, &replay);
+
+    unsigned long start = millis();
+    SessionResult result;
+    runSession(cell, &result);
+    // Reading past the last record marks the replay finished
+    replay.available();
+
+    bool ok = result.connected &&
+        result.reply == SESSION_REPLY &&
+        result.queued == 0 &&
+        replay.getMismatches() == 0 &&
+        replay.finished();
+    printf("replay at %g: %lu ms, %u mismatches, reply %zu bytes, %u records left, %s\n",
+        speed, millis() - start, replay.getMismatches(), result.reply.size(), result.queued,
+        ok ? "ok" : "FAILED");
+    return ok;
+}
+
+int main(int argc, char** argv)
+{
+    const char* path = argc > 1 ? argv[1] : "captures/session.pnc";
+    bool ok;
+    if (argc > 2)
+    {
+        ok = replay(path, atof(argv[2]));
+    }
+    else
+    {
+        ok = replay(path, 1.0);
+        ok &= replay(path, 0);
+    }
+    printf(ok ? "PASS\n" : "FAIL\n");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,354 @@
+// Queue sends, compression, receive and link recovery against a
+// simulated module. Driver internals are set up directly, so the tests
+// start from a registered module with an open socket.
+#include <string>
+#include <vector>
+#include "fake_modem.h"
+#define private public
+#include "picsil-Nano.h"
+#include "picsil-NanoFleet.h"
+#undef private
+
+static void attach(NanoCellular& cell, FakeModem& modem)
+{
+    cell._uart = &modem;
+    cell._socket = 1;
+    cell._registration = NetworkRegistrationState::Registered;
+}
+
+static std::vector<uint8_t> makeRecord(int n)
+{
+    std::vector<uint8_t> record(1 + (n * 7) % 30);
+    for (size_t i = 0; i < record.size(); i++)
+    {
+        record[i] = (n * 31 + i) & 0xFF;
+    }
+    return record;
+}
+
+// Records as they go out on the socket, each after its length byte
+static std::vector<uint8_t> expected(int count)
+{
+    std::vector<uint8_t> bytes;
+    for (int n = 0; n < count; n++)
+    {
+        std::vector<uint8_t> record = makeRecord(n);
+        bytes.push_back(record.size());
+        bytes.insert(bytes.end(), record.begin(), record.end());
+    }
+    return bytes;
+}
+
+static std::string decompress(const std::vector<uint8_t>& wire)
+{
+    static NanoLz lz;
+    lz.reset();
+    std::string out;
+    uint8_t buffer[64];
+    size_t position = 0;
+    while (position < wire.size())
+    {
+        uint16_t consumed;
+        uint16_t length = lz.decompress(wire.data() + position, wire.size() - position, &consumed, buffer, sizeof(buffer));
+        out.append((const char*)buffer, length);
+        position += consumed;
+        if (length == 0 &&
+            consumed == 0)
+        {
+            break;
+        }
+    }
+    return out;
+}
+
+static bool queueSend()
+{
+    // Records arrive intact and poll() never waits on a reply
+    FakeModem modem;
+    NanoCellular cell;
+    attach(cell, modem);
+    for (int n = 0; n < 20; n++)
+    {
+        std::vector<uint8_t> record = makeRecord(n);
+        cell.queueRecord(record.data(), record.size());
+    }
+    unsigned long start = millis();
+    unsigned long longest = 0;
+    while (cell.getQueuedRecords() > 0 &&
+        millis() - start < 100000)
+    {
+        unsigned long before = millis();
+        cell.poll();
+        longest = max(longest, millis() - before);
+        hostAdvance(1);
+    }
+    bool ok = modem.received == expected(20) &&
+        longest < 50;
+    printf("queue send: %lu ms, longest poll %lu ms, %d sends, %s\n",
+        millis() - start, longest, modem.sends, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+static bool fleet()
+{
+    // Three modules send the same records in under half the time of one
+    unsigned long times[2];
+    bool ok = true;
+    for (int count : { 1, 3 })
+    {
+        FakeModem modems[3];
+        NanoCellular cells[3];
+        NanoFleet fleet;
+        for (int i = 0; i < count; i++)
+        {
+            attach(cells[i], modems[i]);
+            fleet.addModem(&cells[i]);
+        }
+        unsigned long start = millis();
+        int written = 0;
+        while (millis() - start < 600000)
+        {
+            if (written < 28 &&
+                millis() % 5 == 0)
+            {
+                std::vector<uint8_t> record = makeRecord(written);
+                if (fleet.write(record.data(), record.size()))
+                {
+                    written++;
+                }
+            }
+            fleet.poll();
+            hostAdvance(1);
+            FleetStats stats;
+            fleet.getStats(&stats);
+            if (written == 28 &&
+                stats.queued == 0)
+            {
+                break;
+            }
+        }
+        size_t total = 0;
+        for (int i = 0; i < count; i++)
+        {
+            total += modems[i].received.size();
+        }
+        times[count == 3] = millis() - start;
+        ok &= total == expected(28).size();
+        printf("fleet of %d: %lu ms, %zu bytes\n", count, times[count == 3], total);
+    }
+    ok &= times[1] * 2 < times[0];
+    printf("fleet: %s\n", ok ? "ok" : "FAILED");
+    return ok;
+}
+
+static bool compressedQueue()
+{
+    // Text written between queue sends lands between whole batches
+    FakeModem modem;
+    NanoCellular cell;
+    attach(cell, modem);
+    static NanoLz lz;
+    cell.setCompression(&lz);
+    for (int n = 0; n < 20; n++)
+    {
+        std::vector<uint8_t> record = makeRecord(n);
+        cell.queueRecord(record.data(), record.size());
+    }
+    for (int i = 0; i < 400; i++)
+    {
+        cell.poll();
+        hostAdvance(1);
+    }
+    const char* text = "written in between";
+    cell.write((const uint8_t*)text, strlen(text));
+    cell.flush();
+    unsigned long start = millis();
+    while (cell.getQueuedRecords() > 0 &&
+        millis() - start < 100000)
+    {
+        cell.poll();
+        hostAdvance(1);
+    }
+    std::string out = decompress(modem.received);
+    std::vector<uint8_t> records = expected(20);
+    size_t at = out.find(text);
+    bool ok = at != std::string::npos;
+    if (ok)
+    {
+        out.erase(at, strlen(text));
+        size_t position = 0;
+        while (position < at)
+        {
+            position += 1 + records[position];
+        }
+        ok = position == at &&
+            std::vector<uint8_t>(out.begin(), out.end()) == records;
+    }
+    printf("compressed queue: %zu bytes on the wire, text at %zu, %s\n",
+        modem.received.size(), at, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+static bool smallWrites()
+{
+    // Small writes are gathered into blocks before they are compressed
+    FakeModem modem;
+    NanoCellular cell;
+    attach(cell, modem);
+    modem.latency = 5;
+    static NanoLz lz;
+    cell.setCompression(&lz);
+    std::string all;
+    for (int i = 0; i < 100; i++)
+    {
+        char text[16];
+        sprintf(text, "v=%03d;", i);
+        all += text;
+        cell.write((const uint8_t*)text, strlen(text));
+    }
+    cell.flush();
+    bool ok = decompress(modem.received) == all &&
+        modem.sends < 15;
+    printf("small writes: %zu bytes in %d sends, %zu on the wire, %s\n",
+        all.size(), modem.sends, modem.received.size(), ok ? "ok" : "FAILED");
+    return ok;
+}
+
+static bool receiveHex()
+{
+    // Binary data comes hex encoded, with a URC inside the reply
+    FakeModem modem;
+    NanoCellular cell;
+    attach(cell, modem);
+    cell._registration = NetworkRegistrationState::Searching;
+    for (int i = 0; i < 230; i++)
+    {
+        modem.incoming.push_back(i * 7);
+    }
+    std::vector<uint8_t> want = modem.incoming;
+    std::vector<uint8_t> got;
+    uint8_t buffer[64];
+    int length;
+    while ((length = cell.read(buffer, sizeof(buffer))) > 0)
+    {
+        got.insert(got.end(), buffer, buffer + length);
+    }
+    bool ok = got == want &&
+        cell._registration == NetworkRegistrationState::Roaming;
+    printf("receive: %zu of %zu bytes, %s\n", got.size(), want.size(), ok ? "ok" : "FAILED");
+    return ok;
+}
+
+static bool receiveText()
+{
+    // Text data keeps its line ends and lines that look like replies
+    FakeModem modem;
+    NanoCellular cell;
+    attach(cell, modem);
+    std::string text = "line one\r\nOK\r\n+CEREG: 1\r\nERROR\r\nlast\n";
+    for (int i = 0; i < 8; i++)
+    {
+        modem.incoming.insert(modem.incoming.end(), text.begin(), text.end());
+    }
+    std::vector<uint8_t> want = modem.incoming;
+    std::vector<uint8_t> got;
+    uint8_t buffer[64];
+    int length;
+    while ((length = cell.read(buffer, sizeof(buffer))) > 0)
+    {
+        got.insert(got.end(), buffer, buffer + length);
+    }
+    modem.incoming.push_back('x');
+    int c = cell.read();
+    int none = cell.read();
+    bool ok = got == want &&
+        c == 'x' &&
+        none == -1;
+    printf("text receive: %zu of %zu bytes, %s\n", got.size(), want.size(), ok ? "ok" : "FAILED");
+    return ok;
+}
+
+static bool recovery()
+{
+    // A broken link is reopened without poll() blocking
+    FakeModem modem;
+    NanoCellular cell;
+    attach(cell, modem);
+    strcpy(cell._host, "example.com");
+    cell._port = 80;
+    cell.setSupervisor(true);
+    cell._linkFailures = LINK_FAILURE_LIMIT;
+    cell._probeTime = millis();
+    unsigned long start = millis();
+    unsigned long longest = 0;
+    bool started = false;
+    while (millis() - start < 20000)
+    {
+        unsigned long before = millis();
+        cell.poll();
+        longest = max(longest, millis() - before);
+        hostAdvance(1);
+        started |= cell.getRecoveryStep() != RecoveryStep::None;
+        if (started &&
+            cell.getRecoveryStep() == RecoveryStep::None)
+        {
+            break;
+        }
+    }
+    bool ok = started &&
+        cell.getRecoveryStep() == RecoveryStep::None &&
+        cell._socket == 2 &&
+        longest < 50;
+    printf("recovery: %lu ms, longest poll %lu ms, %s\n", millis() - start, longest, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+static bool background()
+{
+    // Probe, cell cache and FOTA resume run from poll() without blocking
+    FakeModem modem;
+    NanoCellular cell;
+    attach(cell, modem);
+    cell.setSupervisor(true);
+    cell._registration = NetworkRegistrationState::Searching;
+    cell._probeTime = millis() - LINK_PROBE_INTERVAL;
+    cell._cellCacheStale = true;
+    strcpy(cell._fotaUrl, "http://example.com/fw");
+    cell._fotaStage = FotaStage::Paused;
+    cell._fotaTime = millis() - FOTA_RETRY_INTERVAL;
+    unsigned long start = millis();
+    unsigned long longest = 0;
+    while (millis() - start < 1000)
+    {
+        unsigned long before = millis();
+        cell.poll();
+        longest = max(longest, millis() - before);
+        hostAdvance(1);
+    }
+    CellCache cache;
+    cell.getCellCache(&cache);
+    bool ok = cell._registration == NetworkRegistrationState::Registered &&
+        cache.valid &&
+        cache.band == 20 &&
+        strcmp(cache.plmn, "26201") == 0 &&
+        cache.cellId == 0x11B07 &&
+        cell.getFotaStage() == FotaStage::Downloading &&
+        longest == 0;
+    printf("background: longest poll %lu ms, %s\n", longest, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+int main()
+{
+    bool ok = true;
+    ok &= queueSend();
+    ok &= fleet();
+    ok &= compressedQueue();
+    ok &= smallWrites();
+    ok &= receiveHex();
+    ok &= receiveText();
+    ok &= recovery();
+    ok &= background();
+    printf(ok ? "PASS\n" : "FAIL\n");
+    return ok ? 0 : 1;
+}
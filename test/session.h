@@ -0,0 +1,59 @@
+#ifndef __test_session_h__
+#define __test_session_h__
+#include <string>
+#include "picsil-Nano.h"
+
+#define SESSION_HOST    "example.com"
+#define SESSION_PORT    80
+#define SESSION_REQUEST "GET / HTTP/1.0\r\n\r\n"
+#define SESSION_REPLY   "HTTP/1.0 200 OK\r\nContent-Length: 5\r\n\r\nhello"
+#define SESSION_RECORDS 12
+
+struct SessionResult
+{
+    bool connected;
+    std::string reply;
+    uint16_t queued;
+};
+
+// Starts from a registered module on the given stream, in place of the
+// power up and attach begin() goes through
+static void attachSession(NanoCellular& cell, Stream* stream)
+{
+    cell._uart = stream;
+    cell._registration = NetworkRegistrationState::Registered;
+}
+
+// The session in captures/session.pnc: connects, sends a request, reads
+// the reply, lets poll() send queued records and closes the socket.
+// Changing it means recording the capture again, see the Makefile.
+static void runSession(NanoCellular& cell, SessionResult* result)
+{
+    result->connected = cell.connect(SESSION_HOST, SESSION_PORT) == 1;
+    cell.write((const uint8_t*)SESSION_REQUEST, strlen(SESSION_REQUEST));
+
+    uint8_t buffer[64];
+    int length;
+    while ((length = cell.read(buffer, sizeof(buffer))) > 0)
+    {
+        result->reply.append((const char*)buffer, length);
+    }
+
+    for (uint8_t n = 0; n < SESSION_RECORDS; n++)
+    {
+        uint8_t record[8];
+        memset(record, n, sizeof(record));
+        cell.queueRecord(record, 1 + n % sizeof(record));
+    }
+    unsigned long start = millis();
+    while (cell.getQueuedRecords() > 0 &&
+        millis() - start < 60000)
+    {
+        cell.poll();
+        hostAdvance(1);
+    }
+    result->queued = cell.getQueuedRecords();
+    cell.stop();
+}
+
+#endif